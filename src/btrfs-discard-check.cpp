@@ -1,1014 +1,614 @@
-#include <string>
-#include <string_view>
-#include <memory>
-#include <stdexcept>
 #include <iostream>
+#include <fstream>
+#include <filesystem>
 #include <format>
+#include <stdexcept>
+#include <string_view>
+#include <charconv>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <vector>
-#include <map>
-#include <nlohmann/json.hpp>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <span>
+#include <iterator>
 
-import cxxbtrfs;
-import formatted_error;
+import discard_check;
+import nbd;
+import vhdx;
+import vmdk;
 
 using namespace std;
-using json = nlohmann::json;
-
-#define MAX_STRIPES 2
-
-static bool errors_found = false;
-
-static const uint64_t INCOMPAT_FLAGS = btrfs::FEATURE_INCOMPAT_MIXED_BACKREF |
-                                       btrfs::FEATURE_INCOMPAT_DEFAULT_SUBVOL |
-                                       btrfs::FEATURE_INCOMPAT_MIXED_GROUPS |
-                                       btrfs::FEATURE_INCOMPAT_COMPRESS_LZO |
-                                       btrfs::FEATURE_INCOMPAT_COMPRESS_ZSTD |
-                                       btrfs::FEATURE_INCOMPAT_BIG_METADATA |
-                                       btrfs::FEATURE_INCOMPAT_EXTENDED_IREF |
-                                       btrfs::FEATURE_INCOMPAT_SKINNY_METADATA |
-                                       btrfs::FEATURE_INCOMPAT_NO_HOLES |
-                                       btrfs::FEATURE_INCOMPAT_METADATA_UUID |
-                                       btrfs::FEATURE_INCOMPAT_SIMPLE_QUOTA |
-                                       btrfs::FEATURE_INCOMPAT_REMAP_TREE;
-
-struct chunk : btrfs::chunk {
-    btrfs::stripe next_stripes[MAX_STRIPES - 1];
-};
-
-class pcloser {
-public:
-    using pointer = FILE*;
-
-    void operator()(FILE* f) {
-        pclose(f);
-    }
-};
-
-class mapping {
-public:
-    mapping(const char* filename);
-    ~mapping();
-
-    span<const uint8_t> get_span() const {
-        return span((uint8_t*)addr, length);
-    }
-
-    void* addr;
-    size_t length;
-};
-
-struct qcow_map {
-    bool data;
-    bool present;
-    bool zero;
-    uint64_t start;
-    uint64_t length;
-    uint64_t offset;
-};
-
-class qcow {
-public:
-    qcow(const char* filename);
-    void read(uint64_t offset, span<uint8_t> buf) const;
-
-    mapping mmap;
-    vector<qcow_map> qm;
-};
-
-mapping::mapping(const char* filename) {
-    auto fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        throw formatted_error("open failed (errno {})", errno);
-
-    struct stat st;
-    if (fstat(fd, &st) == -1) {
-        close(fd);
-        throw formatted_error("fstat failed (errno {})", errno);
-    }
-
-    length = st.st_size;
 
-    addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
-    if (addr == MAP_FAILED) {
-        close(fd);
-        throw formatted_error("mmap failed (errno {})", errno);
-    }
-
-    close(fd);
-}
-
-mapping::~mapping() {
-    munmap(addr, length);
-}
-
-static string qemu_img_map(const char* filename) {
-    string cmd = "qemu-img map --output json "s + filename;
-
-    char buf[255];
-    string ret;
-    unique_ptr<FILE, pcloser> pipe{popen(cmd.data(), "r")};
+template<typename T>
+static optional<T> parse_number(string_view s) {
+    T ret;
 
-    if (!pipe)
-        throw formatted_error("popen failed (errno {})", errno);
+    auto [ptr, ec] = from_chars(s.data(), s.data() + s.size(), ret);
 
-    while (fgets(buf, sizeof(buf), pipe.get())) {
-        ret += buf;
-    }
+    if (ec != errc() || ptr != s.data() + s.size())
+        return nullopt;
 
     return ret;
 }
 
-static json get_map(const char* filename) {
-    auto s = qemu_img_map(filename);
-
-    auto map = json::parse(s);
-
-    if (map.type() != json::value_t::array)
-        throw runtime_error("JSON was not an array");
+// decimal, or hex with 0x in front
+static optional<uint64_t> parse_address(string_view s) {
+    uint64_t ret;
+    int base = 10;
 
-    for (const auto& m : map) {
-        if ((bool)m["compressed"])
-            throw runtime_error("Cannot handle compressed qcow2 files.");
+    if (s.starts_with("0x")) {
+        s = s.substr(2);
+        base = 16;
     }
 
-    return map;
-}
+    auto [ptr, ec] = from_chars(s.data(), s.data() + s.size(), ret, base);
 
-qcow::qcow(const char* filename) : mmap(filename) {
-    auto map = get_map(filename);
+    if (s.empty() || ec != errc() || ptr != s.data() + s.size())
+        return nullopt;
 
-    for (const auto& m : map) {
-        auto data = (bool)m.at("data");
-        auto present = (bool)m.at("present");
-        auto zero = (bool)m.at("zero");
-        auto start = (uint64_t)m.at("start");
-        auto length = (uint64_t)m.at("length");
-        auto offset = !zero ? (uint64_t)m.at("offset") : 0;
+    return ret;
+}
 
-        qm.emplace_back(data, present, zero, start, length, offset);
-    }
+static void usage() {
+    cerr << R"(Usage: btrfs-dischard-check [options] <qcow-vhdx-or-vmdk-image>
+       btrfs-dischard-check [options] nbd://<host>[:<port>][/<export>]
+       btrfs-dischard-check [options] nbd+unix:///<export>?socket=<path>
+       btrfs-dischard-check merge [--metrics <file>] <partial-result>...
+
+Options:
+    --threads <n>           number of threads to use (default: one per CPU)
+    --stats                 print timings for each phase of the check
+    --sample <n>            only check a stratified random sample of n block
+                            groups, and estimate the leak rate from that
+    --time-budget <secs>    when sampling, stop after this many seconds
+    --seed <n>              random seed to use when sampling
+    --metrics <file>        write wasted and at-risk space metrics to file, in
+                            Prometheus text format
+    --verify-data           read all checksummed data and verify it
+    --fix                   discard the parts of the image which are allocated
+                            but free in btrfs (image must not be in use)
+    --host-usage            report how much of the space btrfs has freed has
+                            been given back to the host filesystem
+    --snapshots             check each of the image's internal qcow2 snapshots
+                            rather than its current state
+    --csum-coverage         check that nothing with a checksum has been
+                            discarded, reading only metadata
+    --tree-blocks           check that no tree block in any tree has been
+                            discarded
+    --extent-tree           check that the extent tree and the free space tree
+                            agree with each other
+    --block-groups          check that the block group items agree with the
+                            chunks and the free space tree
+    --attribute             say which tree and file each problem range belongs to
+    --zero-scan             read the ranges which are allocated but free, and
+                            say which of them are all zeroes
+    --bookends              report how much of each data block group is taken up
+                            by parts of extents which nothing refers to
+    --range <start>:<len>   only check the block groups starting in this
+                            physical range of the image
+    --partial <file>        write the findings and metrics to file, for
+                            combining with the other ranges using merge
+    --index-dir <dir>       keep an index of each qcow2 image's allocation map
+                            in dir, to speed up checking it again
+)";
 }
 
-void qcow::read(uint64_t offset, span<uint8_t> buf) const {
-    auto sp = mmap.get_span();
+static void write_file(const filesystem::path& fn, string_view contents) {
+    // write to a temporary file and rename, so nobody ever sees it half-written
 
-    while (true) {
-        for (const auto& m : qm) {
-            if (m.start <= offset && m.start + m.length > offset) {
-                auto to_copy = min(buf.size(), m.start + m.length - offset);
+    auto tmp = fn;
+    tmp += ".tmp";
 
-                if (m.zero)
-                    memset(buf.data(), 0, to_copy);
-                else {
-                    memcpy(buf.data(), sp.data() + m.offset + offset - m.start,
-                           to_copy);
-                }
+    {
+        ofstream f(tmp);
 
-                if (buf.size() == to_copy)
-                    return;
+        if (!f)
+            throw runtime_error("could not open " + tmp.string() + " for writing");
 
-                offset += to_copy;
-                buf = buf.subspan(to_copy);
+        f << contents;
 
-                break;
-            } else if (m.start >= offset + buf.size())
-                throw runtime_error("mappings not contiguous");
-        }
+        if (!f)
+            throw runtime_error("error writing " + tmp.string());
     }
+
+    filesystem::rename(tmp, fn);
 }
 
-static const pair<uint64_t, const chunk&> find_chunk(const map<uint64_t, chunk>& chunks,
-                                                     uint64_t address) {
-    auto it = chunks.upper_bound(address);
+static void write_metrics(const filesystem::path& fn, const discard_check::metrics& m,
+                          string_view image_name) {
+    write_file(fn, discard_check::prometheus_text(m, image_name));
+}
 
-    if (it == chunks.begin())
-        throw formatted_error("could not find address {:x} in chunks", address);
+static discard_check::partial_result read_partial(const char* fn) {
+    ifstream f(fn);
 
-    const auto& p = *prev(it);
+    if (!f)
+        throw runtime_error("could not open " + string(fn));
 
-    if (p.first + p.second.length <= address)
-        throw formatted_error("could not find address {:x} in chunks", address);
+    string s{istreambuf_iterator<char>(f), istreambuf_iterator<char>()};
 
-    return p;
+    return discard_check::parse_partial_result(s);
 }
 
-template<typename T>
-concept walk_func = requires(T t) {
-    is_invocable_v<T, const btrfs::key&, span<const uint8_t>>;
-    { t(*(btrfs::key*)nullptr, span<const uint8_t>()) } -> same_as<bool>;
-};
-
-static bool walk_tree(const qcow& q, const btrfs::super_block& sb, uint64_t address,
-                      uint8_t exp_level, uint64_t exp_generation,
-                      uint64_t exp_owner, const map<uint64_t, chunk>& chunks,
-                      walk_func auto func);
-
-static uint64_t resolve_remap(const qcow& q, const btrfs::super_block& sb,
-                              uint64_t address, const map<uint64_t, chunk>& chunks) {
-    uint64_t ret;
-
-    // FIXME - do something like btrfs_search_slot rather than walking
+static int merge(int argc, char* argv[]) {
+    const char* metrics_file = nullptr;
+    vector<const char*> files;
 
-    walk_tree(q, sb, sb.remap_root, sb.remap_root_level, sb.remap_root_generation,
-              btrfs::REMAP_TREE_OBJECTID, chunks,
-              [address, &ret](const btrfs::key& key, span<const uint8_t> sp) {
-        if (key.type != btrfs::key_type::REMAP && key.type != btrfs::key_type::IDENTITY_REMAP)
-            return true;
+    for (int i = 2; i < argc; i++) {
+        string_view arg = argv[i];
 
-        if (key.objectid > address)
-            throw formatted_error("could not resolve remap for address {:x}", address);
+        if (arg == "--metrics" && i + 1 < argc)
+            metrics_file = argv[++i];
+        else if (!arg.starts_with("--"))
+            files.push_back(argv[i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
 
-        if (key.objectid <= address && key.objectid + key.offset > address) {
-            if (key.type == btrfs::key_type::IDENTITY_REMAP)
-                ret = address;
-            else {
-                if (sp.size() < sizeof(btrfs::remap)) {
-                    throw formatted_error("REMAP was {} bytes, expected {}",
-                                          sp.size(), sizeof(btrfs::remap));
-                }
+    if (files.empty()) {
+        usage();
+        return 1;
+    }
 
-                const auto& r = *(btrfs::remap*)sp.data();
+    bool errors_found = false;
 
-                ret = address - key.objectid + r.address;
-            }
+    try {
+        vector<discard_check::partial_result> parts;
 
-            return false;
+        for (auto fn : files) {
+            parts.push_back(read_partial(fn));
         }
 
-        return true;
-    });
+        auto pr = discard_check::merge_partial_results(move(parts));
 
-    return ret;
-}
-
-static uint64_t get_physical_address(const qcow& q, const btrfs::super_block& sb,
-                                     uint64_t address, const map<uint64_t, chunk>& chunks) {
-    auto& [chunk_start, c] = find_chunk(chunks, address);
+        if (pr.range_start != 0 || pr.range_length < pr.image_size) {
+            cerr << format("warning: partial results only cover {:x} to {:x} of {:x}", pr.range_start,
+                           pr.range_start + pr.range_length, pr.image_size) << endl;
+        }
 
-    if (c.type & btrfs::BLOCK_GROUP_REMAPPED)
-        return get_physical_address(q, sb, resolve_remap(q, sb, address, chunks), chunks);
+        for (const auto& f : pr.findings) {
+            cerr << format("{}", f) << endl;
 
-    switch (btrfs::get_chunk_raid_type(c)) {
-        case btrfs::raid_type::RAID0:
-        case btrfs::raid_type::RAID10:
-        case btrfs::raid_type::RAID5:
-        case btrfs::raid_type::RAID6:
-            throw formatted_error("unsupported RAID type {}", btrfs::get_chunk_raid_type(c));
+            if (discard_check::is_error(f))
+                errors_found = true;
+        }
 
-        default:
-            break;
+        if (metrics_file)
+            write_metrics(metrics_file, pr.m, pr.image_name);
+    } catch (const exception& e) {
+        cerr << "Exception: " << e.what() << endl;
+        return 1;
     }
 
-    return address - chunk_start + c.stripe[0].offset;
+    return errors_found ? 1 : 0;
 }
 
-static bool walk_tree(const qcow& q, const btrfs::super_block& sb, uint64_t address,
-                      uint8_t exp_level, uint64_t exp_generation,
-                      uint64_t exp_owner, const map<uint64_t, chunk>& chunks,
-                      walk_func auto func) {
-    vector<uint8_t> v;
-
-    v.resize(sb.nodesize);
+static void print_stats(const discard_check::stats& st) {
+    cerr << format("load: {:.3f}s", st.load.count()) << endl;
+    cerr << format("dev tree: {:.3f}s", st.dev_tree.count()) << endl;
 
-    auto phys_address = get_physical_address(q, sb, address, chunks);
+    if (st.block_group_items.count() != 0)
+        cerr << format("block group items: {:.3f}s", st.block_group_items.count()) << endl;
 
-    q.read(phys_address, v);
+    cerr << format("free space tree: {:.3f}s", st.free_space.count()) << endl;
+    cerr << format("merge: {:.3f}s ({} block groups, {} full or empty, {} threads)", st.merge.count(),
+                   st.block_groups, st.trivial_block_groups, st.threads) << endl;
 
-    auto& h = *(btrfs::header*)v.data();
+    if (st.extent_tree.count() != 0)
+        cerr << format("extent tree: {:.3f}s", st.extent_tree.count()) << endl;
 
-    if (!btrfs::check_tree_csum(h, sb)) {
-        throw formatted_error("csum error while reading tree block at {:x}",
-                              address);
+    if (st.tree_blocks_checked != 0) {
+        cerr << format("tree blocks: {:.3f}s ({} blocks)", st.tree_blocks.count(),
+                       st.tree_blocks_checked) << endl;
     }
 
-    if (h.bytenr != address) {
-        throw formatted_error("tree address header mismatch ({:x}, expected {:x})",
-                              (uint64_t)h.bytenr, address);
-    }
+    if (st.csum_coverage.count() != 0)
+        cerr << format("csum coverage: {:.3f}s", st.csum_coverage.count()) << endl;
 
-    if (h.level != exp_level) {
-        throw formatted_error("tree block at {:x} had level {}, expected {}",
-                              address, h.level, exp_level);
+    if (st.data_csum_bytes != 0) {
+        cerr << format("data checksums: {:.3f}s ({} bytes)", st.data_csum.count(),
+                       st.data_csum_bytes) << endl;
     }
 
-    if (h.generation != exp_generation) {
-        throw formatted_error("tree block at {:x} had generation {:x}, expected {:x}",
-                              address, (uint64_t)h.generation, exp_generation);
+    if (st.bookends.count() != 0) {
+        cerr << format("bookends: {:.3f}s ({} backrefs)", st.bookends.count(),
+                       st.bookend_refs) << endl;
     }
 
-    if (h.owner != exp_owner) {
-        throw formatted_error("tree block at {:x} had owner {:x}, expected {:x}",
-                              address, (uint64_t)h.owner, exp_owner);
-    }
+    cerr << format("allocations: {} ({} from the heap)", st.allocations, st.heap_allocations) << endl;
 
-    if (h.level > 0) {
-        span items((btrfs::key_ptr*)(v.data() + sizeof(btrfs::header)),
-                   h.nritems);
-
-        for (const auto& it : items) {
-            if (!walk_tree(q, sb, it.blockptr, exp_level - 1, it.generation,
-                           exp_owner, chunks, func)) {
-                return false;
-            }
-        }
+    if (st.rmap_extents != 0) {
+        cerr << format("reverse map build: {:.3f}s ({} extents, {} refs)", st.rmap_build.count(),
+                       st.rmap_extents, st.rmap_refs) << endl;
+        cerr << format("reverse map lookups: {:.3f}s ({} lookups)", st.rmap_lookup.count(),
+                       st.rmap_lookups) << endl;
+    }
+}
 
-        return true;
+static void print_owner(const discard_check::extent_owner& o) {
+    if (o.tree == 0) {
+        cerr << format("    address {:x}, length {:x}: owner unknown", o.address, o.length) << endl;
+    } else if (o.inode == 0) {
+        cerr << format("    address {:x}, length {:x}: tree {}", o.address, o.length, o.tree) << endl;
     } else {
-        span items((btrfs::item*)(v.data() + sizeof(btrfs::header)), h.nritems);
-
-        for (const auto& it : items) {
-            auto sp = span((uint8_t*)v.data() + sizeof(btrfs::header) + it.offset,
-                        it.size);
-
-            if (!func(it.key, sp))
-                return false;
-        }
-
-        return true;
+        cerr << format("    address {:x}, length {:x}: tree {}, inode {}, offset {:x}", o.address,
+                       o.length, o.tree, o.inode, o.offset) << endl;
     }
 }
 
-template<typename T>
-concept find_item_func = is_invocable_v<T, span<const uint8_t>>;
-
-static bool find_item(const qcow& q, const btrfs::super_block& sb, uint64_t address,
-                      uint8_t exp_level, uint64_t exp_generation,
-                      uint64_t exp_owner, const map<uint64_t, chunk>& chunks,
-                      const btrfs::key& search_key, find_item_func auto func) {
-    vector<uint8_t> v;
-
-    v.resize(sb.nodesize);
-
-    auto phys_address = get_physical_address(q, sb, address, chunks);
+static void print_bookends(const vector<discard_check::bookend_usage>& bookends) {
+    uint64_t unreferenced = 0, allocated = 0;
 
-    q.read(phys_address, v);
-
-    auto& h = *(btrfs::header*)v.data();
-
-    if (!btrfs::check_tree_csum(h, sb)) {
-        throw formatted_error("csum error while reading tree block at {:x}",
-                              address);
-    }
+    for (const auto& b : bookends) {
+        cout << format("block group {:x}: {:x} bytes in unreferenced parts of extents, {:x} allocated in image",
+                       b.block_group, b.unreferenced_bytes, b.allocated_bytes) << endl;
 
-    if (h.bytenr != address) {
-        throw formatted_error("tree address header mismatch ({:x}, expected {:x})",
-                              (uint64_t)h.bytenr, address);
+        unreferenced += b.unreferenced_bytes;
+        allocated += b.allocated_bytes;
     }
 
-    if (h.level != exp_level) {
-        throw formatted_error("tree block at {:x} had level {}, expected {}",
-                              address, h.level, exp_level);
-    }
+    cout << format("total: {} bytes in unreferenced parts of extents, {} allocated in image",
+                   unreferenced, allocated) << endl;
+}
 
-    if (h.generation != exp_generation) {
-        throw formatted_error("tree block at {:x} had generation {:x}, expected {:x}",
-                              address, (uint64_t)h.generation, exp_generation);
-    }
+static void print_host_usage(const discard_check::metrics& m, const discard_check::host_usage& hu) {
+    uint64_t free_bytes = 0, wasted_bytes = 0;
 
-    if (h.owner != exp_owner) {
-        throw formatted_error("tree block at {:x} had owner {:x}, expected {:x}",
-                              address, (uint64_t)h.owner, exp_owner);
+    for (const auto& [k, wm] : m.block_groups) {
+        free_bytes += wm.free_bytes;
+        wasted_bytes += wm.wasted_bytes;
     }
 
-    if (h.level > 0) {
-        span items((btrfs::key_ptr*)(v.data() + sizeof(btrfs::header)),
-                   h.nritems);
+    cout << format("free in btrfs: {} bytes", free_bytes) << endl;
+    cout << format("  released by qcow2: {} bytes", free_bytes - wasted_bytes) << endl;
+    cout << format("  still allocated in qcow2: {} bytes", wasted_bytes) << endl;
+    cout << format("host file: {} bytes, of which {} allocated", hu.file_size, hu.allocated_bytes) << endl;
+    cout << format("  in use by qcow2: {} bytes", hu.referenced_bytes) << endl;
+    cout << format("  not in use by qcow2: {} bytes", hu.unreferenced_bytes) << endl;
+    cout << format("    reclaimed on host: {} bytes", hu.reclaimed_bytes) << endl;
+    cout << format("    still taking up space on host: {} bytes", hu.unreclaimed_bytes) << endl;
+}
 
-        for (size_t i = 0; i < items.size(); i++) {
-            if (items[i].key == search_key)
-                return find_item(q, sb, items[i].blockptr, exp_level - 1,
-                                 items[i].generation, exp_owner, chunks,
-                                 search_key, func);
+static unique_ptr<discard_check::image> open_other_image(const char* filename) {
+    uint8_t magic[8];
+    ifstream f(filename, ios::binary);
 
-            if (items[i].key > search_key) {
-                if (i == 0)
-                    return false;
+    if (!f.read((char*)magic, sizeof(magic)))
+        return nullptr;
 
-                return find_item(q, sb, items[i - 1].blockptr, exp_level - 1,
-                                 items[i - 1].generation, exp_owner, chunks,
-                                 search_key, func);
-            }
-        }
+    if (discard_check::vhdx::is_vhdx(magic))
+        return make_unique<discard_check::vhdx>(filename);
+    else if (discard_check::vmdk::is_vmdk(magic))
+        return make_unique<discard_check::vmdk>(filename);
 
-        return find_item(q, sb, items[items.size() - 1].blockptr, exp_level - 1,
-                         items[items.size() - 1].generation, exp_owner, chunks,
-                         search_key, func);
-    } else {
-        span items((btrfs::item*)(v.data() + sizeof(btrfs::header)), h.nritems);
-
-        for (const auto& it : items) {
-            if (it.key == search_key) {
-                func(span((uint8_t*)v.data() + sizeof(btrfs::header) + it.offset,
-                          it.size));
+    return nullptr;
+}
 
-                return true;
-            } else if (it.key > search_key)
-                return false;
-        }
+static bool check_snapshots(const discard_check::qcow& q, discard_check::options opts) {
+    auto snaps = q.snapshots();
+    bool errors_found = false;
 
+    if (snaps.empty()) {
+        cerr << "image has no internal snapshots" << endl;
         return false;
     }
-}
-
-static map<uint64_t, chunk> load_chunks(const qcow& q, const btrfs::super_block& sb) {
-    map<uint64_t, chunk> sys_chunks, chunks;
-
-    auto sys_array = span(sb.sys_chunk_array.data(), sb.sys_chunk_array_size);
 
-    while (!sys_array.empty()) {
-        if (sys_array.size() < sizeof(btrfs::key))
-            throw runtime_error("sys array truncated");
+    // share the threads out between the snapshots
 
-        auto& k = *(btrfs::key*)sys_array.data();
+    auto threads = opts.threads != 0 ? opts.threads : max(thread::hardware_concurrency(), 1u);
 
-        if (k.type != btrfs::key_type::CHUNK_ITEM)
-            throw formatted_error("unexpected key type {} in sys array", k.type);
+    opts.threads = max(threads / (unsigned int)snaps.size(), 1u);
 
-        sys_array = sys_array.subspan(sizeof(btrfs::key));
+    vector<vector<discard_check::finding>> results(snaps.size());
+    vector<exception_ptr> errors(snaps.size());
 
-        if (sys_array.size() < offsetof(btrfs::chunk, stripe))
-            throw runtime_error("sys array truncated");
+    {
+        vector<jthread> workers;
 
-        auto& c = *(chunk*)sys_array.data();
+        for (size_t i = 0; i < snaps.size(); i++) {
+            workers.emplace_back([&q, &opts, &results, &errors, i]() {
+                try {
+                    discard_check::qcow_snapshot snap(q, i);
+                    discard_check::checker c(snap, opts);
 
-        if (sys_array.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)))
-            throw runtime_error("sys array truncated");
-
-        if (c.num_stripes > MAX_STRIPES) {
-            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
-                                  (uint16_t)c.num_stripes, MAX_STRIPES);
+                    results[i] = c.check();
+                } catch (...) {
+                    errors[i] = current_exception();
+                }
+            });
         }
-
-        sys_array = sys_array.subspan(offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
-
-        sys_chunks.insert(make_pair((uint64_t)k.offset, c));
     }
 
-    walk_tree(q, sb, sb.chunk_root, sb.chunk_root_level, sb.chunk_root_generation,
-              btrfs::CHUNK_TREE_OBJECTID, sys_chunks, [&chunks](const btrfs::key& k, span<const uint8_t> sp) {
-        if (k.type != btrfs::key_type::CHUNK_ITEM || k.objectid != btrfs::FIRST_CHUNK_TREE_OBJECTID)
-            return true;
-
-        if (sp.size() < offsetof(btrfs::chunk, stripe)) {
-            throw formatted_error("CHUNK_ITEM truncated ({} bytes, expected at least {})",
-                                  sp.size(), offsetof(btrfs::chunk, stripe));
-        }
-
-        auto& c = *(chunk*)sp.data();
-
-        if (sp.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe))) {
-            throw formatted_error("CHUNK_ITEM truncated ({} bytes, expected {})",
-                                  sp.size(), offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
-        }
-
-        if (c.num_stripes > MAX_STRIPES) {
-            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
-                                  (uint16_t)c.num_stripes, MAX_STRIPES);
-        }
-
-        chunks.insert(make_pair((uint64_t)k.offset, c));
-
-        return true;
-    });
-
-    return chunks;
-}
-
-enum class btrfs_alloc {
-    unallocated,
-    superblock,
-    chunk,
-    chunk_used,
-    chunk_free
-};
-
-template<>
-struct std::formatter<enum btrfs_alloc> {
-    constexpr auto parse(format_parse_context& ctx) {
-        auto it = ctx.begin();
-
-        if (it != ctx.end() && *it != '}')
-            throw format_error("invalid format");
+    for (size_t i = 0; i < snaps.size(); i++) {
+        cerr << format("snapshot {} ({}):", snaps[i].id, snaps[i].name) << endl;
 
-        return it;
-    }
+        if (errors[i]) {
+            try {
+                rethrow_exception(errors[i]);
+            } catch (const exception& e) {
+                cerr << "Exception: " << e.what() << endl;
+            }
 
-    template<typename format_context>
-    auto format(enum btrfs_alloc t, format_context& ctx) const {
-        switch (t) {
-            case btrfs_alloc::unallocated:
-                return format_to(ctx.out(), "unallocated");
-            case btrfs_alloc::superblock:
-                return format_to(ctx.out(), "superblock");
-            case btrfs_alloc::chunk:
-                return format_to(ctx.out(), "chunk");
-            case btrfs_alloc::chunk_used:
-                return format_to(ctx.out(), "chunk_used");
-            case btrfs_alloc::chunk_free:
-                return format_to(ctx.out(), "chunk_free");
-            default:
-                return format_to(ctx.out(), "{}", (unsigned int)t);
+            errors_found = true;
+            continue;
         }
-    }
-};
-
-struct btrfs_extent {
-    uint64_t offset;
-    uint64_t length;
-    enum btrfs_alloc alloc;
-    uint64_t address;
-};
-
-struct qcow_extent {
-    uint64_t offset;
-    uint64_t length;
-    bool alloc;
-};
-
-struct extent2 {
-    uint64_t offset;
-    uint64_t length;
-    bool qcow_alloc;
-    enum btrfs_alloc btrfs_alloc;
-    uint64_t address;
-};
-
-static void carve_out_superblocks(vector<btrfs_extent>& extents) {
-    vector<btrfs_extent> ret;
-
-    for (const auto& e : extents) {
-        bool superblock_added = false;
-
-        for (auto addr : btrfs::superblock_addrs) {
-            if (addr >= e.offset && addr + sizeof(btrfs::super_block) <= e.offset + e.length) {
-                if (addr > e.offset) {
-                    ret.emplace_back(e.offset, addr - e.offset, e.alloc,
-                                     e.address);
-                }
 
-                ret.emplace_back(addr, sizeof(btrfs::super_block),
-                                 btrfs_alloc::superblock,
-                                 e.alloc == btrfs_alloc::unallocated ? 0 : e.address + addr - e.offset);
+        for (const auto& f : results[i]) {
+            cerr << format("{}", f) << endl;
 
-                if (e.offset + e.length > addr + sizeof(btrfs::super_block) ) {
-                    ret.emplace_back(addr + sizeof(btrfs::super_block),
-                                     e.offset + e.length - addr - sizeof(btrfs::super_block),
-                                     e.alloc, e.address + addr + sizeof(btrfs::super_block) - e.offset);
-                }
-
-                superblock_added = true;
-                break;
-            }
+            if (discard_check::is_error(f))
+                errors_found = true;
         }
-
-        if (!superblock_added)
-            ret.push_back(move(e));
     }
 
-    extents.swap(ret);
+    return errors_found;
 }
 
-static map<uint64_t, vector<extent2>> check_dev_tree(const qcow& q,
-                                                     const map<uint64_t, chunk>& chunks,
-                                                     const btrfs::super_block& sb) {
-    uint64_t dev_root, dev_generation;
-    uint8_t dev_level;
-
-    static const btrfs::key search_key = { btrfs::DEV_TREE_OBJECTID, btrfs::key_type::ROOT_ITEM, 0 };
-
-    if (!find_item(q, sb, sb.root, sb.root_level, sb.generation, btrfs::ROOT_TREE_OBJECTID,
-                   chunks, search_key, [&dev_root, &dev_level, &dev_generation](span<const uint8_t> sp) {
-        if (sp.size() < sizeof(btrfs::root_item)) {
-            throw formatted_error("ROOT_ITEM truncated ({} bytes, expected {})",
-                                  sp.size(), sizeof(btrfs::root_item));
-        }
-
-        auto& ri = *(btrfs::root_item*)sp.data();
+int main(int argc, char* argv[]) {
+    bool errors_found = false, show_stats = false, snapshots = false, host_usage = false;
+    bool fix = false, attribute = false, bookends = false;
+    const char* filename = nullptr;
+    discard_check::options opts;
+    optional<discard_check::sample_options> sample;
+    const char* metrics_file = nullptr;
+    const char* partial_file = nullptr;
+    const char* index_dir = "";
+
+    if (argc >= 2 && string_view(argv[1]) == "merge")
+        return merge(argc, argv);
+
+    for (int i = 1; i < argc; i++) {
+        string_view arg = argv[i];
+
+        if (arg == "--stats")
+            show_stats = true;
+        else if (arg == "--verify-data")
+            opts.verify_data = true;
+        else if (arg == "--fix")
+            fix = true;
+        else if (arg == "--host-usage")
+            host_usage = true;
+        else if (arg == "--snapshots")
+            snapshots = true;
+        else if (arg == "--csum-coverage")
+            opts.csum_coverage = true;
+        else if (arg == "--tree-blocks")
+            opts.tree_blocks = true;
+        else if (arg == "--extent-tree")
+            opts.extent_tree = true;
+        else if (arg == "--attribute")
+            attribute = true;
+        else if (arg == "--zero-scan")
+            opts.zero_scan = true;
+        else if (arg == "--bookends")
+            bookends = true;
+        else if (arg == "--block-groups")
+            opts.block_groups = true;
+        else if (arg == "--threads" && i + 1 < argc) {
+            auto n = parse_number<unsigned int>(argv[++i]);
+
+            if (!n) {
+                usage();
+                return 1;
+            }
 
-        dev_root = (uint64_t)ri.bytenr;
-        dev_level = ri.level;
-        dev_generation = ri.generation;
-    }))
-        throw runtime_error("ROOT_ITEM for dev tree not found");
+            opts.threads = *n;
+        } else if (arg == "--sample" && i + 1 < argc) {
+            auto n = parse_number<size_t>(argv[++i]);
 
-    vector<btrfs_extent> extents;
-    vector<qcow_extent> qcow_extents;
+            if (!n || *n == 0) {
+                usage();
+                return 1;
+            }
 
-    optional<uint64_t> last_end;
-    walk_tree(q, sb, dev_root, dev_level, dev_generation, btrfs::DEV_TREE_OBJECTID,
-              chunks, [&extents, &last_end](const btrfs::key& k, span<const uint8_t> sp) {
-        if (k.type != btrfs::key_type::DEV_EXTENT || k.objectid != 1)
-            return true;
+            if (!sample)
+                sample.emplace();
 
-        if (sp.size() < sizeof(btrfs::dev_extent)) {
-            throw formatted_error("DEV_EXTENT truncated ({} bytes, expected {})",
-                                  sp.size(), sizeof(btrfs::dev_extent));
-        }
+            sample->block_groups = *n;
+        } else if (arg == "--time-budget" && i + 1 < argc) {
+            auto n = parse_number<double>(argv[++i]);
 
-        auto& de = *(btrfs::dev_extent*)sp.data();
-        auto length = de.length;
+            if (!n || *n <= 0.0) {
+                usage();
+                return 1;
+            }
 
-        if (!last_end.has_value()) {
-            if (k.offset != 0)
-                extents.emplace_back(0, k.offset, btrfs_alloc::unallocated, 0);
-        } else if (k.offset > *last_end)
-            extents.emplace_back(*last_end, k.offset - *last_end,
-                                 btrfs_alloc::unallocated,  0);
+            if (!sample)
+                sample.emplace();
 
-        extents.emplace_back(k.offset, length, btrfs_alloc::chunk,
-                             (uint64_t)de.chunk_offset);
+            sample->time_budget = chrono::duration<double>(*n);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            auto n = parse_number<uint64_t>(argv[++i]);
 
-        last_end = k.offset + length;
+            if (!n) {
+                usage();
+                return 1;
+            }
 
-        return true;
-    });
+            if (!sample)
+                sample.emplace();
 
-    auto size = q.qm.back().start + q.qm.back().length;
+            sample->seed = *n;
+        } else if (arg == "--range" && i + 1 < argc) {
+            string_view r = argv[++i];
+            auto colon = r.find(':');
+            optional<uint64_t> start, length;
 
-    if (!last_end.has_value())
-        extents.emplace_back(0, size, btrfs_alloc::unallocated, 0);
-    else if (*last_end < size) {
-        extents.emplace_back(*last_end, size - *last_end,
-                             btrfs_alloc::unallocated, 0);
-    }
+            if (colon != string_view::npos) {
+                start = parse_address(r.substr(0, colon));
+                length = parse_address(r.substr(colon + 1));
+            }
 
-    for (const auto& m : q.qm) {
-        if (!qcow_extents.empty() &&
-            qcow_extents.back().offset + qcow_extents.back().length == m.start &&
-            !!qcow_extents.back().alloc == !m.zero) {
-            qcow_extents.back().length += m.length;
-        } else
-            qcow_extents.emplace_back(m.start, m.length, !m.zero);
-    }
+            if (!start || !length || *length == 0) {
+                usage();
+                return 1;
+            }
 
-    carve_out_superblocks(extents);
-
-    vector<extent2> merged;
-
-    size_t i = 0, j = 0;
-    while (i < extents.size() && j < qcow_extents.size()) {
-        auto& be = extents[i];
-        auto& qe = qcow_extents[j];
-
-        if (be.length == qe.length) {
-            merged.emplace_back(be.offset, be.length, qe.alloc, be.alloc,
-                                be.address);
-            i++;
-            j++;
-        } else if (be.length < qe.length) {
-            merged.emplace_back(be.offset, be.length, qe.alloc, be.alloc,
-                                be.address);
-            qe.offset += be.length;
-            qe.length -= be.length;
-            i++;
-        } else {
-            merged.emplace_back(be.offset, qe.length, qe.alloc, be.alloc,
-                                be.address);
-            be.offset += qe.length;
-            be.length -= qe.length;
-            be.address += qe.length;
-            j++;
+            opts.range_start = *start;
+            opts.range_length = *length;
+        } else if (arg == "--metrics" && i + 1 < argc)
+            metrics_file = argv[++i];
+        else if (arg == "--partial" && i + 1 < argc)
+            partial_file = argv[++i];
+        else if (arg == "--index-dir" && i + 1 < argc)
+            index_dir = argv[++i];
+        else if (!filename && !arg.starts_with("--"))
+            filename = argv[i];
+        else {
+            usage();
+            return 1;
         }
     }
 
-    map<uint64_t, vector<extent2>> by_chunk;
-
-    for (auto& m : merged) {
-        uint64_t chunk_address;
-
-        if (m.btrfs_alloc == btrfs_alloc::chunk || (m.btrfs_alloc == btrfs_alloc::superblock && m.address != 0)) {
-            auto it = chunks.upper_bound(m.address);
-
-            chunk_address = prev(it)->first;
-        } else
-            chunk_address = 0;
-
-        by_chunk[chunk_address].push_back(move(m));
-    }
-
-    for (const auto& bc : by_chunk) {
-        if (bc.first == 0) {
-            for (const auto& m : bc.second) {
-                if (m.btrfs_alloc == btrfs_alloc::superblock && !m.qcow_alloc) {
-                    cerr << format("superblock at {:x} not allocated", m.offset) << endl;
-                    errors_found = true;
-                } else if (m.btrfs_alloc == btrfs_alloc::unallocated && m.qcow_alloc) {
-                    if (m.offset + m.length <= btrfs::DEVICE_RANGE_RESERVED)
-                        continue;
-
-                    uint64_t offset, length;
-
-                    if (m.offset < btrfs::DEVICE_RANGE_RESERVED) {
-                        offset = btrfs::DEVICE_RANGE_RESERVED;
-                        length = m.offset + m.length - btrfs::DEVICE_RANGE_RESERVED;
-                    } else {
-                        offset = m.offset;
-                        length = m.length;
-                    }
-
-                    cerr << format("qcow range {:x}, {:x} allocated but not part of any btrfs chunk",
-                                   offset, length) << endl;
-                    errors_found = true;
-                }
-            }
-        }
+    if (!filename ||
+        (snapshots && (sample || metrics_file || show_stats || host_usage || fix || attribute)) ||
+        (sample && (metrics_file || host_usage || fix || bookends)) ||
+        (fix && opts.zero_scan) ||
+        (snapshots && bookends) ||
+        ((opts.range_length != 0 || partial_file) && (snapshots || sample || host_usage))) {
+        usage();
+        return 1;
     }
 
-    return by_chunk;
-}
+    try {
+        if (snapshots) {
+            discard_check::qcow q(filename, index_dir);
 
-struct space_entry {
-    uint64_t address;
-    uint64_t length;
-    bool alloc;
-};
-
-struct space_entry2 {
-    uint64_t log_address;
-    uint64_t phys_address;
-    uint64_t length;
-    bool alloc;
-};
-
-static map<uint64_t, vector<space_entry2>> read_fst(const qcow& q,
-                                                    const map<uint64_t, chunk>& chunks,
-                                                    const btrfs::super_block& sb) {
-    uint64_t fst_root, fst_generation;
-    uint8_t fst_level;
-
-    static const btrfs::key search_key = { btrfs::FREE_SPACE_TREE_OBJECTID, btrfs::key_type::ROOT_ITEM, 0 };
-
-    if (!find_item(q, sb, sb.root, sb.root_level, sb.generation, btrfs::ROOT_TREE_OBJECTID,
-                   chunks, search_key, [&fst_root, &fst_level, &fst_generation](span<const uint8_t> sp) {
-        if (sp.size() < sizeof(btrfs::root_item)) {
-            throw formatted_error("ROOT_ITEM truncated ({} bytes, expected {})",
-                                  sp.size(), sizeof(btrfs::root_item));
+            return check_snapshots(q, opts) ? 1 : 0;
         }
 
-        auto& ri = *(btrfs::root_item*)sp.data();
-
-        fst_root = (uint64_t)ri.bytenr;
-        fst_level = ri.level;
-        fst_generation = ri.generation;
-    }))
-        throw runtime_error("ROOT_ITEM for free space tree not found");
+        unique_ptr<discard_check::image> img;
 
-    vector<pair<uint64_t, uint64_t>> free_space;
+        discard_check::qcow* q = nullptr;
 
-    walk_tree(q, sb, fst_root, fst_level, fst_generation, btrfs::FREE_SPACE_TREE_OBJECTID,
-              chunks, [&free_space, &sb](const btrfs::key& k, span<const uint8_t> sp) {
-        if (k.type == btrfs::key_type::FREE_SPACE_EXTENT)
-            free_space.emplace_back(k.objectid, k.offset);
-        else if (k.type == btrfs::key_type::FREE_SPACE_BITMAP) {
-            vector<pair<uint64_t, uint64_t>> bmp;
-
-            unsigned int pos = 0;
-
-            while (!sp.empty()) {
-                auto num = sp[0];
-
-                for (unsigned int i = 0; i < 8; i++) {
-                    if (num & 1) {
-                        if (!bmp.empty() && bmp.back().first + bmp.back().second == pos)
-                            bmp.back().second++;
-                        else
-                            bmp.emplace_back(pos, 1);
-                    }
-
-                    pos++;
-                    num >>= 1;
-                }
-
-                sp = sp.subspan(1);
+        if (discard_check::is_nbd_uri(filename)) {
+            if (host_usage || fix) {
+                usage();
+                return 1;
             }
 
-            for (const auto& b : bmp) {
-                free_space.emplace_back(k.objectid + (b.first * sb.sectorsize),
-                                        b.second * sb.sectorsize);
-            }
-        }
-
-        return true;
-    });
-
-    map<uint64_t, vector<space_entry>> space;
-
-    for (auto& f : free_space) {
-        uint64_t chunk_address;
-
-        auto it = chunks.upper_bound(f.first);
-
-        if (it == chunks.begin()) {
-            cerr << format("free space entry {:x}, {:x} not part of any chunk",
-                           f.first, f.second) << endl;
-            errors_found = true;
-            continue;
-        }
-
-        chunk_address = prev(it)->first;
-
-        if (!space.contains(chunk_address)) {
-            if (f.first > chunk_address) {
-                space[chunk_address].emplace_back(chunk_address,
-                            f.first - chunk_address, true);
+            img = make_unique<discard_check::nbd>(filename);
+        } else if ((img = open_other_image(filename))) {
+            if (host_usage || fix) {
+                usage();
+                return 1;
             }
         } else {
-            const auto& l = space[chunk_address].back();
+            auto qp = make_unique<discard_check::qcow>(filename, index_dir);
 
-            if (f.first > l.address + l.length) {
-                space[chunk_address].emplace_back(l.address + l.length,
-                            f.first - l.address - l.length, true);
-            }
+            q = qp.get();
+            img = move(qp);
         }
 
-        space[chunk_address].emplace_back(f.first, f.second, false);
-    }
-
-    // handle fully-allocated chunks
-
-    for (const auto& c : chunks) {
-        if (!space.contains(c.first))
-            space[c.first].emplace_back(c.first, c.second.length, true);
-    }
-
-    for (auto& bc : space) {
-        auto& c = chunks.at(bc.first);
-
-        if (bc.second.empty())
-            bc.second.emplace_back(bc.first, c.length, false);
-        else {
-            const auto& l = bc.second.back();
+        discard_check::checker c(*img, opts);
 
-            if (l.address + l.length < bc.first + c.length) {
-                bc.second.emplace_back(l.address + l.length,
-                                       bc.first + c.length - l.address - l.length,
-                                       false);
-            }
-        }
-    }
+        if (fix && c.has_log_tree())
+            throw runtime_error("filesystem has a log tree, mount it to replay it before using --fix");
 
-    map<uint64_t, vector<space_entry2>> space2;
+        discard_check::stats st;
+        optional<discard_check::reverse_map> rmap;
 
-    for (auto& bc : space) {
-        auto& c = chunks.at(bc.first);
+        if (attribute)
+            rmap.emplace(c.build_reverse_map(show_stats ? &st : nullptr));
 
-        vector<const btrfs::stripe*> stripes;
+        vector<pair<uint64_t, uint64_t>> to_discard;
+        vector<discard_check::finding> findings;
+        bool fst_suspect = false, rechecking = false;
 
-        for (unsigned int i = 0; i < c.num_stripes; i++) {
-            stripes.push_back(&c.stripe[i]);
-        }
+        auto report = [&](const discard_check::finding& f) {
+            cerr << format("{}", f) << endl;
 
-        sort(stripes.begin(), stripes.end(), [](const auto& a, const auto& b) {
-            return a->offset < b->offset;
-        });
+            if (rmap) {
+                for (const auto& o : rmap->lookup(f, show_stats ? &st : nullptr)) {
+                    print_owner(o);
+                }
+            }
 
-        for (const auto& s : stripes) {
-            for (const auto& f : bc.second) {
-                uint64_t phys = f.address - bc.first + s->offset;
+            if (discard_check::is_error(f)) {
+                errors_found = true;
 
-                space2[bc.first].emplace_back(f.address, phys, f.length, f.alloc);
+                // Wasted space outside the chunks says nothing about the
+                // free space tree, but anything else means we can't trust it.
+                if (f.type != discard_check::finding_type::allocated_but_free &&
+                    f.type != discard_check::finding_type::allocated_outside_chunk) {
+                    fst_suspect = true;
+                }
             }
-        }
-    }
-
-    return space2;
-}
 
-static void do_merge2(uint64_t chunk_address, vector<extent2>& dev_extents,
-                      vector<space_entry2>& space) {
-    (void)chunk_address;
+            if (partial_file)
+                findings.push_back(f);
 
-#if 0
-    cout << format("chunk {:x}:", chunk_address) << endl;
+            if (fix && !rechecking && f.type == discard_check::finding_type::allocated_but_free)
+                to_discard.emplace_back(f.offset, f.length);
+        };
 
-    for (const auto& m : dev_extents) {
-        cout << format("physical address {:x}, length {:x}, qcow_alloc {}, logical address {:x}\n",
-                       m.offset, m.length, m.qcow_alloc, m.address);
-    }
+        if (sample) {
+            auto res = c.sample(*sample, report, show_stats ? &st : nullptr);
 
-    for (const auto& f : space) {
-        cout << format("space: physical address {:x}, length {:x}, logical address {:x}, alloc {}",
-                       f.phys_address, f.length, f.log_address, f.alloc) << endl;
-    }
-#endif
-
-    vector<extent2> merged;
-
-    size_t i = 0, j = 0;
-    while (i < dev_extents.size() && j < space.size()) {
-        auto& d = dev_extents[i];
-        auto& s = space[j];
-
-        enum btrfs_alloc alloc;
-
-        if (d.btrfs_alloc == btrfs_alloc::superblock)
-            alloc = btrfs_alloc::superblock;
-        else if (s.alloc)
-            alloc = btrfs_alloc::chunk_used;
-        else
-            alloc = btrfs_alloc::chunk_free;
-
-        assert(d.offset == s.phys_address);
-
-        if (d.length == s.length) {
-            merged.emplace_back(d.offset, d.length, d.qcow_alloc, alloc,
-                                d.address);
-            i++;
-            j++;
-        } else if (d.length < s.length) {
-            merged.emplace_back(d.offset, d.length, d.qcow_alloc, alloc,
-                                d.address);
-            s.phys_address += d.length;
-            s.log_address += d.length;
-            s.length -= d.length;
-            i++;
+            cout << format("checked {} of {} block groups, estimated leak rate {:.1f}% (95% confidence {:.1f}% to {:.1f}%)",
+                           res.sampled, res.block_groups, res.leak_rate * 100.0,
+                           res.leak_rate_lower * 100.0, res.leak_rate_upper * 100.0) << endl;
         } else {
-            merged.emplace_back(d.offset, s.length, d.qcow_alloc, alloc,
-                                d.address);
-            d.offset += s.length;
-            d.address += s.length;
-            d.length -= s.length;
-            j++;
-        }
-    }
+            discard_check::metrics m;
 
-#if 0
-    for (const auto& f : merged) {
-        cout << format("merged: physical address {:x}, length {:x}, logical address {:x}, qcow_alloc {}, btrfs_alloc {}",
-                       f.offset, f.length, f.address, f.qcow_alloc,
-                       f.btrfs_alloc) << endl;
-    }
-#endif
+            c.check(report, show_stats ? &st : nullptr,
+                    metrics_file || host_usage || partial_file ? &m : nullptr);
 
-    for (const auto& f : merged) {
-        if (f.qcow_alloc && f.btrfs_alloc == btrfs_alloc::chunk_free) {
-            cerr << format("qcow range {:x}, {:x} allocated (address {:x}) but is free space",
-                           f.offset, f.length, f.address) << endl;
-            errors_found = true;
-        } else if (!f.qcow_alloc && f.btrfs_alloc == btrfs_alloc::chunk_used) {
-            cerr << format("qcow range {:x}, {:x} discarded (address {:x}) but is allocated",
-                           f.offset, f.length, f.address) << endl;
-            errors_found = true;
-        }
-    }
-}
-
-static void do_merge(map<uint64_t, vector<extent2>>& dev_extents,
-                     map<uint64_t, vector<space_entry2>>& space) {
-    for (auto& d : dev_extents) {
-        if (d.first == 0)
-            continue;
-
-        do_merge2(d.first, d.second, space.at(d.first));
-    }
-}
+            if (fix && fst_suspect)
+                cerr << "not fixing, as the free space tree can't be trusted" << endl;
+            else if (fix && !to_discard.empty()) {
+                auto discarded = q->discard(to_discard);
 
-static void check_qcow(const char* filename) {
-    qcow q(filename);
+                cout << format("discarded {} bytes", discarded) << endl;
 
-    btrfs::super_block sb;
+                // Check again, so that the exit code and metrics are for the
+                // image as it is now. Anything left is printed again, so it's
+                // clear why we're still failing - partial clusters, ones
+                // shared with a snapshot, ones in a backing file, etc.
 
-    // FIXME - if first superblock not valid, check others
+                errors_found = false;
+                findings.clear();
+                m = {};
+                rechecking = true;
 
-    q.read(btrfs::superblock_addrs[0], span((uint8_t*)&sb, sizeof(sb)));
+                cerr << "after fixing:" << endl;
 
-    if (sb.magic != btrfs::MAGIC)
-        throw runtime_error("volume was not btrfs");
-
-    if (sb.num_devices != 1)
-        throw runtime_error("multi-device filesystems not supported");
-
-    if (!btrfs::check_superblock_csum(sb))
-        throw runtime_error("superblock csum mismatch");
-
-    if (sb.incompat_flags & ~INCOMPAT_FLAGS)
-        throw formatted_error("unsupported incompat flags {:x}", sb.incompat_flags & ~INCOMPAT_FLAGS);
+                c.check(report, nullptr, metrics_file || host_usage || partial_file ? &m : nullptr);
+            }
 
-    auto chunks = load_chunks(q, sb);
+            if (metrics_file)
+                write_metrics(metrics_file, m, filename);
 
-    auto dev_extents = check_dev_tree(q, chunks, sb);
+            if (partial_file) {
+                discard_check::partial_result pr;
 
-    if (!(sb.compat_ro_flags & btrfs::FEATURE_COMPAT_RO_FREE_SPACE_TREE)) {
-        cerr << "not analysing free space as filesystem is not using free space tree" << endl;
-        return;
-    }
+                pr.image_name = filename;
+                pr.image_size = img->size();
+                pr.range_start = opts.range_start;
+                pr.range_length = opts.range_length != 0 ?
+                                  min(opts.range_length, pr.image_size - opts.range_start) :
+                                  pr.image_size;
+                pr.findings = move(findings);
+                pr.m = move(m);
 
-    auto space = read_fst(q, chunks, sb);
+                write_file(partial_file, discard_check::partial_result_json(pr));
+            }
 
-    do_merge(dev_extents, space);
-}
+            if (host_usage)
+                print_host_usage(m, q->host_usage());
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cerr << "Usage: btrfs-dischard-check <qcow-image>" << endl;
-        return 1;
-    }
+            if (bookends)
+                print_bookends(c.bookends(show_stats ? &st : nullptr));
+        }
 
-    try {
-        check_qcow(argv[1]);
+        if (show_stats)
+            print_stats(st);
     } catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
         return 1;
@@ -3,6 +3,17 @@ module;
 #include <stdint.h>
 #include <array>
 #include <format>
+#include <vector>
+#include <span>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 
 export module cxxbtrfs;
 
@@ -43,7 +54,7 @@ static const uint32_t crctable[] = {
     0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
 };
 
-static uint32_t calc_crc32c(uint32_t seed, span<const uint8_t> msg) {
+static uint32_t calc_crc32c_sw(uint32_t seed, span<const uint8_t> msg) {
     uint32_t rem = seed;
 
     for (auto b : msg) {
@@ -53,6 +64,83 @@ static uint32_t calc_crc32c(uint32_t seed, span<const uint8_t> msg) {
     return rem;
 }
 
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t calc_crc32c_hw(uint32_t seed, span<const uint8_t> msg) {
+    uint64_t rem = seed;
+    auto p = msg.data();
+    auto len = msg.size();
+
+    while (len >= sizeof(uint64_t)) {
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+        rem = _mm_crc32_u64(rem, v);
+
+        p += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    while (len > 0) {
+        rem = _mm_crc32_u8((uint32_t)rem, *p);
+        p++;
+        len--;
+    }
+
+    return (uint32_t)rem;
+}
+
+// The crc32 instruction has a latency of three cycles but a throughput of one
+// per cycle, so working on four blocks at once keeps it busy rather than
+// waiting on the previous result.
+__attribute__((target("sse4.2")))
+static void calc_crc32c_hw_x4(const uint8_t* data, size_t block_size, uint32_t* out) {
+    uint64_t rem0 = 0xffffffff, rem1 = 0xffffffff, rem2 = 0xffffffff, rem3 = 0xffffffff;
+    auto p0 = data;
+    auto p1 = data + block_size;
+    auto p2 = data + (2 * block_size);
+    auto p3 = data + (3 * block_size);
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= block_size; i += sizeof(uint64_t)) {
+        uint64_t v0, v1, v2, v3;
+
+        memcpy(&v0, p0 + i, sizeof(uint64_t));
+        memcpy(&v1, p1 + i, sizeof(uint64_t));
+        memcpy(&v2, p2 + i, sizeof(uint64_t));
+        memcpy(&v3, p3 + i, sizeof(uint64_t));
+
+        rem0 = _mm_crc32_u64(rem0, v0);
+        rem1 = _mm_crc32_u64(rem1, v1);
+        rem2 = _mm_crc32_u64(rem2, v2);
+        rem3 = _mm_crc32_u64(rem3, v3);
+    }
+
+    for (; i < block_size; i++) {
+        rem0 = _mm_crc32_u8((uint32_t)rem0, p0[i]);
+        rem1 = _mm_crc32_u8((uint32_t)rem1, p1[i]);
+        rem2 = _mm_crc32_u8((uint32_t)rem2, p2[i]);
+        rem3 = _mm_crc32_u8((uint32_t)rem3, p3[i]);
+    }
+
+    out[0] = ~(uint32_t)rem0;
+    out[1] = ~(uint32_t)rem1;
+    out[2] = ~(uint32_t)rem2;
+    out[3] = ~(uint32_t)rem3;
+}
+
+static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+static uint32_t calc_crc32c(uint32_t seed, span<const uint8_t> msg) {
+#ifdef __x86_64__
+    if (have_sse42)
+        return calc_crc32c_hw(seed, msg);
+#endif
+
+    return calc_crc32c_sw(seed, msg);
+}
+
 export namespace btrfs {
 
 constexpr uint64_t superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4000000000000 };
@@ -113,6 +201,9 @@ constexpr uint64_t REMAP_TREE_OBJECTID = 0xd;
 constexpr uint64_t EXTENT_CSUM_OBJECTID = 0xfffffffffffffff6;
 constexpr uint64_t DATA_RELOC_TREE_OBJECTID = 0xfffffffffffffff7;
 
+constexpr uint64_t FIRST_FREE_OBJECTID = 0x100;
+constexpr uint64_t LAST_FREE_OBJECTID = 0xffffffffffffff00;
+
 constexpr uint64_t DEVICE_RANGE_RESERVED = 0x100000;
 
 using uuid = array<uint8_t, 16>;
@@ -396,10 +487,66 @@ struct dev_extent {
     uuid chunk_tree_uuid;
 } __attribute__ ((__packed__));
 
+struct block_group_item {
+    uint64_t used;
+    uint64_t chunk_objectid;
+    uint64_t flags;
+} __attribute__ ((__packed__));
+
 struct remap {
     uint64_t address;
 } __attribute__ ((__packed__));
 
+constexpr uint64_t EXTENT_FLAG_DATA = 1 << 0;
+constexpr uint64_t EXTENT_FLAG_TREE_BLOCK = 1 << 1;
+
+struct extent_item {
+    uint64_t refs;
+    uint64_t generation;
+    uint64_t flags;
+} __attribute__ ((__packed__));
+
+struct tree_block_info {
+    btrfs::key key;
+    uint8_t level;
+} __attribute__ ((__packed__));
+
+static_assert(sizeof(tree_block_info) == 18);
+
+struct extent_data_ref {
+    uint64_t root;
+    uint64_t objectid;
+    uint64_t offset;
+    uint32_t count;
+} __attribute__ ((__packed__));
+
+static_assert(sizeof(extent_data_ref) == 28);
+
+struct shared_data_ref {
+    uint32_t count;
+} __attribute__ ((__packed__));
+
+enum class file_extent_type : uint8_t {
+    INLINE = 0,
+    REG = 1,
+    PREALLOC = 2,
+};
+
+struct file_extent_item {
+    uint64_t generation;
+    uint64_t ram_bytes;
+    uint8_t compression;
+    uint8_t encryption;
+    uint16_t other_encoding;
+    file_extent_type type;
+    uint64_t disk_bytenr;
+    uint64_t disk_num_bytes;
+    uint64_t offset;
+    uint64_t num_bytes;
+} __attribute__ ((__packed__));
+
+static_assert(sizeof(file_extent_item) == 53);
+
 enum class raid_type {
     SINGLE,
     RAID0,
@@ -433,6 +580,224 @@ enum raid_type get_chunk_raid_type(const chunk& c) {
         return raid_type::SINGLE;
 }
 
+// Returns the slot of the child which would contain k, i.e. the last key_ptr
+// whose key is less than or equal to it.
+size_t find_child_slot(span<const key_ptr> items, const key& k) {
+    auto it = upper_bound(items.begin(), items.end(), k, [](const key& a, const key_ptr& b) {
+        return a < b.key;
+    });
+
+    return it == items.begin() ? 0 : (size_t)(it - items.begin() - 1);
+}
+
+// Returns the slot of the first item whose key is greater than or equal to k.
+size_t find_item_slot(span<const item> items, const key& k) {
+    auto it = lower_bound(items.begin(), items.end(), k, [](const item& a, const key& b) {
+        return a.key < b;
+    });
+
+    return (size_t)(it - items.begin());
+}
+
+// Reads and validates the tree block at address, returning its contents.
+using node_reader = function<vector<uint8_t>(uint64_t address, uint8_t level,
+                                             uint64_t generation)>;
+
+// Equivalent of the kernel's btrfs_path - a position within a tree, which
+// remembers the nodes on the way down so it can move on to the next or
+// previous item without going back to the root.
+class tree_cursor {
+public:
+    tree_cursor(node_reader reader, uint64_t root, uint8_t root_level,
+                uint64_t root_generation) :
+                reader(move(reader)), root(root), root_level(root_level),
+                root_generation(root_generation) {
+    }
+
+    // Positions the cursor at the first item whose key is greater than or
+    // equal to k, and returns true if it is an exact match.
+    bool search(const key& k) {
+        auto address = root;
+        auto generation = root_generation;
+
+        path.clear();
+        path.resize(root_level + 1);
+
+        for (int level = root_level; level >= 0; level--) {
+            auto& p = path[level];
+
+            p.node = reader(address, (uint8_t)level, generation);
+
+            if (level > 0) {
+                auto items = child_ptrs(p.node);
+
+                if (items.empty())
+                    throw runtime_error("internal tree node had no items");
+
+                p.slot = find_child_slot(items, k);
+                address = items[p.slot].blockptr;
+                generation = items[p.slot].generation;
+            } else
+                p.slot = find_item_slot(leaf_items(p.node), k);
+        }
+
+        if (path[0].slot >= leaf_items(path[0].node).size()) {
+            if (!next_leaf()) {
+                at_end = true;
+                return false;
+            }
+        }
+
+        at_end = false;
+
+        return item_key() == k;
+    }
+
+    // Moves on to the next item, returning false if there isn't one.
+    bool next() {
+        if (at_end)
+            return false;
+
+        path[0].slot++;
+
+        if (path[0].slot < leaf_items(path[0].node).size())
+            return true;
+
+        if (!next_leaf()) {
+            at_end = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    // Moves back to the previous item, returning false if there isn't one.
+    bool prev() {
+        if (path.empty())
+            return false;
+
+        if (at_end) {
+            // we're one past the last item of the last leaf
+
+            path[0].slot = leaf_items(path[0].node).size();
+            at_end = false;
+        }
+
+        if (path[0].slot > 0) {
+            path[0].slot--;
+            return true;
+        }
+
+        return prev_leaf();
+    }
+
+    bool valid() const {
+        return !path.empty() && !at_end && path[0].slot < leaf_items(path[0].node).size();
+    }
+
+    const key& item_key() const {
+        return leaf_items(path[0].node)[path[0].slot].key;
+    }
+
+    span<const uint8_t> item_data() const {
+        const auto& it = leaf_items(path[0].node)[path[0].slot];
+
+        if (sizeof(header) + it.offset + it.size > path[0].node.size())
+            throw runtime_error("tree item out of bounds");
+
+        return span(path[0].node).subspan(sizeof(header) + it.offset, it.size);
+    }
+
+private:
+    struct path_entry {
+        vector<uint8_t> node;
+        size_t slot;
+    };
+
+    static span<const key_ptr> child_ptrs(const vector<uint8_t>& node) {
+        auto& h = *(const header*)node.data();
+
+        if (sizeof(header) + (h.nritems * sizeof(key_ptr)) > node.size())
+            throw runtime_error("tree node nritems out of range");
+
+        return span((const key_ptr*)(node.data() + sizeof(header)), h.nritems);
+    }
+
+    static span<const item> leaf_items(const vector<uint8_t>& node) {
+        auto& h = *(const header*)node.data();
+
+        if (sizeof(header) + (h.nritems * sizeof(item)) > node.size())
+            throw runtime_error("tree node nritems out of range");
+
+        return span((const item*)(node.data() + sizeof(header)), h.nritems);
+    }
+
+    // Reads the nodes below level, taking either the first or the last child
+    // each time.
+    void descend(size_t level, bool first) {
+        while (level > 0) {
+            const auto& kp = child_ptrs(path[level].node)[path[level].slot];
+            auto& p = path[level - 1];
+
+            p.node = reader(kp.blockptr, (uint8_t)(level - 1), kp.generation);
+
+            if (level - 1 > 0) {
+                auto n = child_ptrs(p.node).size();
+
+                if (n == 0)
+                    throw runtime_error("internal tree node had no items");
+
+                p.slot = first ? 0 : n - 1;
+            } else {
+                auto n = leaf_items(p.node).size();
+
+                p.slot = first ? 0 : (n == 0 ? 0 : n - 1);
+            }
+
+            level--;
+        }
+    }
+
+    bool next_leaf() {
+        for (size_t level = 1; level < path.size(); level++) {
+            if (path[level].slot + 1 < child_ptrs(path[level].node).size()) {
+                path[level].slot++;
+                descend(level, true);
+
+                if (leaf_items(path[0].node).empty())
+                    return false;
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool prev_leaf() {
+        for (size_t level = 1; level < path.size(); level++) {
+            if (path[level].slot > 0) {
+                path[level].slot--;
+                descend(level, false);
+
+                if (leaf_items(path[0].node).empty())
+                    return false;
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    node_reader reader;
+    uint64_t root;
+    uint8_t root_level;
+    uint64_t root_generation;
+    vector<path_entry> path;
+    bool at_end = false;
+};
+
 bool check_superblock_csum(const super_block& sb) {
     // FIXME - xxhash, sha256, blake2
 
@@ -456,6 +821,57 @@ bool check_tree_csum(const header& h, const super_block& sb) {
     return *(uint32_t*)h.csum.data() == crc32;
 }
 
+uint32_t crc32c(span<const uint8_t> msg) {
+    return ~calc_crc32c(0xffffffff, msg);
+}
+
+size_t csum_size(enum csum_type type) {
+    switch (type) {
+        case csum_type::CRC32:
+            return sizeof(uint32_t);
+
+        case csum_type::XXHASH:
+            return sizeof(uint64_t);
+
+        case csum_type::SHA256:
+        case csum_type::BLAKE2:
+            return 32;
+
+        default:
+            throw runtime_error("unrecognized csum type " + to_string((uint16_t)type));
+    }
+}
+
+// Calculates the checksum of each sector of data, in the form in which they
+// are stored in the csum tree.
+void calc_data_csums(enum csum_type type, span<const uint8_t> data, uint32_t sectorsize,
+                     span<uint8_t> csums) {
+    // FIXME - xxhash, sha256, blake2
+
+    if (type != csum_type::CRC32)
+        throw runtime_error("unsupported csum type " + to_string((uint16_t)type));
+
+    auto num_sectors = data.size() / sectorsize;
+
+    if (csums.size() < num_sectors * sizeof(uint32_t))
+        throw runtime_error("csum buffer too small");
+
+    auto out = (uint32_t*)csums.data();
+    size_t i = 0;
+
+#ifdef __x86_64__
+    if (have_sse42) {
+        for (; i + 4 <= num_sectors; i += 4) {
+            calc_crc32c_hw_x4(data.data() + (i * sectorsize), sectorsize, out + i);
+        }
+    }
+#endif
+
+    for (; i < num_sectors; i++) {
+        out[i] = ~calc_crc32c(0xffffffff, data.subspan(i * sectorsize, sectorsize));
+    }
+}
+
 }
 
 template<>
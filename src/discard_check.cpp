@@ -0,0 +1,4990 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <stdexcept>
+#include <format>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <set>
+#include <filesystem>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <numeric>
+#include <mutex>
+#include <random>
+#include <cmath>
+#include <cctype>
+#include <array>
+#include <optional>
+#include <tuple>
+#include <cstring>
+#include <memory_resource>
+#include <nlohmann/json.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+export module discard_check;
+
+import cxxbtrfs;
+import qcow2;
+import formatted_error;
+
+using namespace std;
+using json = nlohmann::json;
+
+#define MAX_STRIPES 2
+
+static const uint64_t INCOMPAT_FLAGS = btrfs::FEATURE_INCOMPAT_MIXED_BACKREF |
+                                       btrfs::FEATURE_INCOMPAT_DEFAULT_SUBVOL |
+                                       btrfs::FEATURE_INCOMPAT_MIXED_GROUPS |
+                                       btrfs::FEATURE_INCOMPAT_COMPRESS_LZO |
+                                       btrfs::FEATURE_INCOMPAT_COMPRESS_ZSTD |
+                                       btrfs::FEATURE_INCOMPAT_BIG_METADATA |
+                                       btrfs::FEATURE_INCOMPAT_EXTENDED_IREF |
+                                       btrfs::FEATURE_INCOMPAT_SKINNY_METADATA |
+                                       btrfs::FEATURE_INCOMPAT_NO_HOLES |
+                                       btrfs::FEATURE_INCOMPAT_METADATA_UUID |
+                                       btrfs::FEATURE_INCOMPAT_SIMPLE_QUOTA |
+                                       btrfs::FEATURE_INCOMPAT_REMAP_TREE;
+
+struct chunk : btrfs::chunk {
+    btrfs::stripe next_stripes[MAX_STRIPES - 1];
+};
+
+// The chunks sorted by logical address, in a flat array rather than a map, as
+// we look them up for every tree block and free space entry. The start
+// addresses are kept in an array of their own so that the binary search
+// stays within a few cache lines, and each thread remembers where its last
+// lookup was, as addresses tend to come in order.
+class chunk_table {
+public:
+    using value_type = pair<uint64_t, chunk>;
+    using const_iterator = vector<value_type>::const_iterator;
+
+    chunk_table() = default;
+
+    chunk_table(const map<uint64_t, chunk>& m) {
+        entries.reserve(m.size());
+        starts.reserve(m.size());
+
+        for (const auto& e : m) {
+            entries.push_back(e);
+            starts.push_back(e.first);
+        }
+    }
+
+    const_iterator begin() const {
+        return entries.begin();
+    }
+
+    const_iterator end() const {
+        return entries.end();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    const_iterator upper_bound(uint64_t address) const {
+        return entries.begin() + upper_index(address);
+    }
+
+    const chunk& at(uint64_t address) const {
+        auto i = upper_index(address);
+
+        if (i == 0 || starts[i - 1] != address)
+            throw out_of_range("chunk_table::at");
+
+        return entries[i - 1].second;
+    }
+
+    // Returns the chunk containing address, or end() if there isn't one.
+    const_iterator find_containing(uint64_t address) const {
+        thread_local const chunk_table* last_table = nullptr;
+        thread_local size_t last = 0;
+
+        if (last_table == this) {
+            // try the same chunk again, then the next one along
+
+            for (auto i = last; i < min(last + 2, entries.size()); i++) {
+                if (contains(i, address)) {
+                    last = i;
+                    return entries.begin() + i;
+                }
+            }
+        }
+
+        auto i = upper_index(address);
+
+        if (i == 0 || !contains(i - 1, address))
+            return entries.end();
+
+        last_table = this;
+        last = i - 1;
+
+        return entries.begin() + last;
+    }
+
+private:
+    bool contains(size_t i, uint64_t address) const {
+        return address >= starts[i] && address - starts[i] < entries[i].second.length;
+    }
+
+    // Returns the number of chunks starting at or before address, i.e. the
+    // index of the first one after it. The loop is written so that the
+    // compiler can use a conditional move rather than a branch.
+    size_t upper_index(uint64_t address) const {
+        if (starts.empty())
+            return 0;
+
+        const uint64_t* first = starts.data();
+        size_t len = starts.size();
+
+        while (len > 1) {
+            auto half = len / 2;
+
+            first += first[half - 1] <= address ? half : 0;
+            len -= half;
+        }
+
+        return (size_t)(first - starts.data()) + (*first <= address ? 1 : 0);
+    }
+
+    vector<value_type> entries;
+    vector<uint64_t> starts;
+};
+
+class pcloser {
+public:
+    using pointer = FILE*;
+
+    void operator()(FILE* f) {
+        pclose(f);
+    }
+};
+
+export namespace discard_check {
+
+class mapping {
+public:
+    mapping(const char* filename);
+    ~mapping();
+
+    span<const uint8_t> get_span() const {
+        return span((uint8_t*)addr, length);
+    }
+
+    void* addr;
+    size_t length;
+};
+
+struct qcow_map {
+    bool data;
+    bool present;
+    bool zero;
+    uint64_t start;
+    uint64_t length;
+    uint64_t offset;
+};
+
+class image {
+public:
+    virtual ~image() = default;
+    virtual void read(uint64_t offset, span<uint8_t> buf) const = 0;
+    virtual uint64_t size() const = 0;
+    virtual vector<qcow_map> alloc_map(uint64_t start, uint64_t length) const = 0;
+
+    // hint that we're about to read this part of the image
+    virtual void will_need(uint64_t, uint64_t) const { }
+
+    // Returns this part of the image without copying it, if it's all in one
+    // place in a mapped file - otherwise an empty span, and it has to be read.
+    virtual span<const uint8_t> mapped(uint64_t, uint64_t) const {
+        return {};
+    }
+};
+
+// An image whose allocation map is worked out up front, and whose data is read
+// from a mapped file.
+class mapped_image : public image {
+public:
+    void read(uint64_t offset, span<uint8_t> buf) const override;
+    vector<qcow_map> alloc_map(uint64_t start, uint64_t length) const override;
+    void will_need(uint64_t offset, uint64_t length) const override;
+    span<const uint8_t> mapped(uint64_t offset, uint64_t length) const override;
+
+    uint64_t size() const override {
+        return virtual_size;
+    }
+
+protected:
+    void add_run(const qcow_map& m);
+
+    span<const uint8_t> file;
+    uint64_t virtual_size = 0;
+    map<uint64_t, qcow_map> qm;
+};
+
+struct host_usage {
+    uint64_t file_size = 0;
+    uint64_t allocated_bytes = 0;   // not holes in the host file
+    uint64_t referenced_bytes = 0;  // clusters with a non-zero refcount
+    uint64_t unreferenced_bytes = 0; // clusters qcow2 isn't using...
+    uint64_t reclaimed_bytes = 0;   // ...which are holes in the host file
+    uint64_t unreclaimed_bytes = 0; // ...which are still taking up space
+};
+
+struct qcow_snapshot_info {
+    string id;
+    string name;
+    uint64_t size;
+};
+
+class qcow : public image {
+public:
+    // If index_dir is given, the allocation map is cached there between runs.
+    qcow(const char* filename, const filesystem::path& index_dir = {});
+    void read(uint64_t offset, span<uint8_t> buf) const override;
+    vector<qcow_map> alloc_map(uint64_t start, uint64_t length) const override;
+    void will_need(uint64_t offset, uint64_t length) const override;
+    span<const uint8_t> mapped(uint64_t offset, uint64_t length) const override;
+    vector<qcow_snapshot_info> snapshots() const;
+    discard_check::host_usage host_usage() const;
+    uint64_t discard(span<const pair<uint64_t, uint64_t>> ranges);
+    void reload();
+
+    uint64_t size() const override {
+        return virtual_size;
+    }
+
+    mapping mmap;
+
+private:
+    friend class qcow_snapshot;
+
+    struct l2_cache_entry {
+        once_flag once;
+        vector<qcow2::cluster_run> runs;
+    };
+
+    void load_map(uint64_t start, uint64_t end) const;
+    void load_native(const qcow2::header& h);
+    const vector<qcow2::cluster_run>& cached_l2(uint64_t l2_offset, uint64_t guest) const;
+    vector<qcow_map> with_backing(const vector<qcow_map>& layer) const;
+    size_t read_backing(uint64_t offset, span<uint8_t> buf) const;
+
+    string filename;
+    filesystem::path index_dir;
+    shared_ptr<const image> backing; // only if native
+    uint64_t virtual_size;
+    bool native = false;
+    mutable mutex mut;
+    mutable map<uint64_t, qcow_map> qm;
+    mutable map<uint64_t, uint64_t> loaded;
+    mutable mutex l2_cache_mutex;
+    mutable map<pair<uint64_t, uint64_t>, shared_ptr<l2_cache_entry>> l2_cache;
+};
+
+// The image as it was at one of its internal snapshots.
+class qcow_snapshot : public mapped_image {
+public:
+    qcow_snapshot(const qcow& q, size_t index);
+};
+
+enum class finding_type {
+    superblock_not_allocated,
+    allocated_outside_chunk,
+    free_space_outside_chunk,
+    allocated_but_free,
+    discarded_but_used,
+    free_space_not_analysed,
+    data_csum_mismatch,
+    discarded_but_checksummed,
+    tree_block_discarded,
+    free_and_used,
+    neither_free_nor_used,
+    block_group_used_mismatch,
+    block_group_flags_mismatch,
+    allocated_but_zeroed
+};
+
+struct finding {
+    finding_type type;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t address;
+    uint64_t expected = 0; // for block group mismatches, what the chunk or FST says...
+    uint64_t actual = 0; // ...and what the block group item says
+};
+
+using finding_func = function<void(const finding&)>;
+
+bool is_error(const finding& f) {
+    // zeroed ranges are wasted space, but not a sign that discard is broken
+    return f.type != finding_type::free_space_not_analysed &&
+           f.type != finding_type::allocated_but_zeroed;
+}
+
+struct options {
+    bool free_space = true;
+    bool verify_data = false; // read data and check it against the csum tree
+    bool csum_coverage = false; // check nothing with a csum has been discarded
+    bool tree_blocks = false; // check no tree block in any tree has been discarded
+    bool extent_tree = false; // check the extent tree and free space tree agree
+    bool zero_scan = false; // read allocated but free ranges to see if they're all zeroes
+    bool block_groups = false; // check the block group items agree with the chunks and FST
+    unsigned int threads = 0; // 0 means one per CPU
+
+    // Only check the block groups whose first stripe starts within this
+    // physical range, and the unallocated space within it - a length of 0
+    // means the whole image. The checks which aren't done block group by
+    // block group still cover everything.
+    uint64_t range_start = 0;
+    uint64_t range_length = 0;
+};
+
+struct stats {
+    chrono::duration<double> load{};
+    chrono::duration<double> dev_tree{};
+    chrono::duration<double> free_space{};
+    chrono::duration<double> merge{};
+    chrono::duration<double> data_csum{};
+    chrono::duration<double> csum_coverage{};
+    chrono::duration<double> tree_blocks{};
+    chrono::duration<double> extent_tree{};
+    chrono::duration<double> block_group_items{};
+    chrono::duration<double> rmap_build{};
+    chrono::duration<double> rmap_lookup{};
+    chrono::duration<double> bookends{};
+    size_t block_groups = 0;
+    size_t trivial_block_groups = 0; // full or empty, so not merged
+    size_t rmap_extents = 0;
+    size_t rmap_refs = 0;
+    size_t rmap_lookups = 0;
+    size_t bookend_refs = 0; // data backrefs followed
+    uint64_t allocations = 0; // made by the check's temporary containers...
+    uint64_t heap_allocations = 0; // ...and how many of those had to go to the heap
+    unsigned int threads = 0;
+    uint64_t data_csum_bytes = 0;
+    size_t tree_blocks_checked = 0;
+};
+
+// upper bounds of the buckets of the leaked range size histogram
+constexpr uint64_t leaked_range_buckets[] = {
+    0x1000, 0x4000, 0x10000, 0x40000, 0x100000, 0x400000, 0x1000000, 0x4000000,
+    0x10000000, 0x40000000
+};
+
+struct waste_metrics {
+    uint64_t free_bytes = 0;    // free according to btrfs
+    uint64_t wasted_bytes = 0;  // free according to btrfs, but not discarded
+    uint64_t at_risk_bytes = 0; // in use according to btrfs, but discarded
+    array<uint64_t, size(leaked_range_buckets) + 1> leaked_ranges{}; // last is +Inf
+
+    void add_leaked_range(uint64_t length) {
+        size_t i = 0;
+
+        while (i < size(leaked_range_buckets) && length > leaked_range_buckets[i]) {
+            i++;
+        }
+
+        leaked_ranges[i]++;
+        wasted_bytes += length;
+    }
+
+    waste_metrics& operator+=(const waste_metrics& wm) {
+        free_bytes += wm.free_bytes;
+        wasted_bytes += wm.wasted_bytes;
+        at_risk_bytes += wm.at_risk_bytes;
+
+        for (size_t i = 0; i < leaked_ranges.size(); i++) {
+            leaked_ranges[i] += wm.leaked_ranges[i];
+        }
+
+        return *this;
+    }
+};
+
+struct metrics {
+    map<pair<string, string>, waste_metrics> block_groups; // by type and profile
+};
+
+string prometheus_text(const metrics& m, string_view image_name);
+
+// The findings and metrics from checking one range of an image, which can be
+// merged with those of the other ranges to give the result for the whole
+// thing.
+struct partial_result {
+    string image_name;
+    uint64_t image_size = 0;
+    uint64_t range_start = 0;
+    uint64_t range_length = 0;
+    vector<finding> findings;
+    metrics m;
+};
+
+string partial_result_json(const partial_result& pr);
+partial_result parse_partial_result(string_view s);
+partial_result merge_partial_results(vector<partial_result> parts);
+
+struct sample_options {
+    size_t block_groups = 100;
+    chrono::duration<double> time_budget{}; // zero means no limit
+    uint64_t seed = 0; // zero means pick one at random
+};
+
+struct sample_result {
+    size_t block_groups = 0;
+    size_t sampled = 0;
+    double leak_rate = 0.0;
+    double leak_rate_lower = 0.0;
+    double leak_rate_upper = 1.0;
+};
+
+// Who a range of a finding belongs to.
+struct extent_owner {
+    uint64_t address; // logical address of the start of the range
+    uint64_t length;
+    uint64_t tree;    // 0 if it couldn't be worked out
+    uint64_t inode;   // 0 for tree blocks
+    uint64_t offset;  // offset within the file of address
+};
+
+// Index from logical address to the owners of each extent, built from the
+// backrefs in the extent tree. It refers to the checker that built it, so
+// mustn't outlive it.
+class reverse_map {
+public:
+    vector<extent_owner> lookup(uint64_t address, uint64_t length, stats* st = nullptr) const;
+    vector<extent_owner> lookup(const finding& f, stats* st = nullptr) const;
+
+private:
+    friend class checker;
+
+    struct extent {
+        uint64_t address;
+        uint32_t length;
+        uint32_t first_ref; // refs run up to the next extent's first_ref
+    };
+
+    struct ref {
+        uint64_t root; // or parent tree block, if shared
+        uint64_t inode; // 0 for tree blocks
+        uint64_t offset; // file offset of the start of the extent
+        bool shared;
+    };
+
+    reverse_map(const image& img, const btrfs::super_block& sb, const chunk_table& chunks) :
+                img(img), sb(sb), chunks(chunks) { }
+    void add_owners(const extent& e, const ref& r, uint64_t start, uint64_t end,
+                    vector<extent_owner>& ret) const;
+
+    const image& img;
+    const btrfs::super_block& sb;
+    const chunk_table& chunks;
+    vector<extent> extents;
+    vector<ref> refs;
+};
+
+// How much of a data block group is taken up by the parts of extents which
+// nothing refers to any more, e.g. after the middle of a file has been
+// overwritten. The free space tree counts these as used, so they can't be
+// discarded until the whole extent is freed.
+struct bookend_usage {
+    uint64_t block_group;
+    uint64_t unreferenced_bytes;
+    uint64_t allocated_bytes; // in the image, counting each stripe
+};
+
+class checker {
+public:
+    checker(const image& img, const options& opts = {});
+    void check(const finding_func& func, stats* st = nullptr, metrics* m = nullptr) const;
+    vector<finding> check(stats* st = nullptr, metrics* m = nullptr) const;
+    sample_result sample(const sample_options& so, const finding_func& func,
+                         stats* st = nullptr) const;
+    reverse_map build_reverse_map(stats* st = nullptr) const;
+    vector<bookend_usage> bookends(stats* st = nullptr) const;
+
+    // Extents written by fsync are only in the log tree until it's replayed,
+    // so until then they look free.
+    bool has_log_tree() const {
+        return sb.log_root != 0;
+    }
+
+private:
+    const image& img;
+    options opts;
+    btrfs::super_block sb;
+    chunk_table chunks;
+    chrono::duration<double> load_time;
+};
+
+}
+
+using namespace discard_check;
+
+mapping::mapping(const char* filename) {
+    auto fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw formatted_error("open failed (errno {})", errno);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw formatted_error("fstat failed (errno {})", errno);
+    }
+
+    length = st.st_size;
+
+    // mmap won't map nothing, but an empty file is still valid
+    if (length == 0) {
+        addr = nullptr;
+        close(fd);
+        return;
+    }
+
+    addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        throw formatted_error("mmap failed (errno {})", errno);
+    }
+
+    close(fd);
+}
+
+mapping::~mapping() {
+    if (addr)
+        munmap(addr, length);
+}
+
+static string run_command(const string& cmd) {
+    char buf[255];
+    string ret;
+    unique_ptr<FILE, pcloser> pipe{popen(cmd.data(), "r")};
+
+    if (!pipe)
+        throw formatted_error("popen failed (errno {})", errno);
+
+    while (fgets(buf, sizeof(buf), pipe.get())) {
+        ret += buf;
+    }
+
+    return ret;
+}
+
+static json get_map(const string& filename, uint64_t start, uint64_t length) {
+    auto s = run_command(format("qemu-img map --output json --start-offset {} --max-length {} {}",
+                                start, length, filename));
+
+    auto map = json::parse(s);
+
+    if (map.type() != json::value_t::array)
+        throw runtime_error("JSON was not an array");
+
+    for (const auto& m : map) {
+        if ((bool)m["compressed"])
+            throw runtime_error("Cannot handle compressed qcow2 files.");
+    }
+
+    return map;
+}
+
+// Whether we can read the allocation map ourselves, rather than having to
+// ask qemu-img.
+static bool can_parse_natively(span<const uint8_t> file) {
+    const auto& h = *(qcow2::header*)file.data();
+
+    if (h.version != 2 && h.version != 3)
+        return false;
+
+    if (h.crypt_method != 0)
+        return false;
+
+    // we can follow the backing chain ourselves if it's all qcow2 or raw files
+
+    if (h.backing_file_offset != 0) {
+        auto fmt = qcow2::read_backing_format(file);
+
+        if (!fmt.empty() && fmt != "qcow2" && fmt != "raw")
+            return false;
+
+        if (qcow2::read_backing_file(file).starts_with("json:"))
+            return false;
+    }
+
+    if (h.cluster_bits < 9 || h.cluster_bits > 21)
+        return false;
+
+    if (h.version == 3 &&
+        h.incompatible_features & ~(qcow2::INCOMPAT_DIRTY | qcow2::INCOMPAT_COMPRESSION)) {
+        return false;
+    }
+
+    return true;
+}
+
+// A raw backing file, which is allocated all the way through.
+class raw_file : public mapped_image {
+public:
+    raw_file(const char* filename) : mmap(filename) {
+        file = mmap.get_span();
+        virtual_size = file.size();
+
+        if (virtual_size != 0)
+            add_run({ true, true, false, 0, virtual_size, 0 });
+    }
+
+private:
+    mapping mmap;
+};
+
+// Base images tend to be shared between lots of overlays, so if several of
+// these are being checked at once, each base only gets opened and parsed once.
+static shared_ptr<const image> open_backing(const string& filename, const string& format,
+                                            const filesystem::path& index_dir) {
+    static recursive_mutex m;
+    static map<string, weak_ptr<const image>> open_files;
+    static set<string> opening;
+
+    auto path = filesystem::weakly_canonical(filename).string();
+
+    lock_guard lg(m);
+
+    if (auto sp = open_files[path].lock())
+        return sp;
+
+    if (opening.contains(path))
+        throw formatted_error("backing chain of {} loops back on itself", path);
+
+    opening.insert(path);
+
+    shared_ptr<const image> ret;
+
+    try {
+        bool is_qcow = format == "qcow2";
+
+        if (format.empty()) {
+            mapping mp(path.c_str());
+            auto sp = mp.get_span();
+
+            is_qcow = sp.size() >= sizeof(uint32_t) && ((qcow2::header*)sp.data())->magic == qcow2::MAGIC;
+        }
+
+        if (is_qcow)
+            ret = make_shared<qcow>(path.c_str(), index_dir);
+        else
+            ret = make_shared<raw_file>(path.c_str());
+    } catch (...) {
+        opening.erase(path);
+        throw;
+    }
+
+    opening.erase(path);
+    open_files[path] = ret;
+
+    return ret;
+}
+
+qcow::qcow(const char* filename, const filesystem::path& index_dir) :
+           mmap(filename), filename(filename), index_dir(index_dir) {
+    auto sp = mmap.get_span();
+
+    if (sp.size() >= sizeof(qcow2::header)) {
+        const auto& h = *(qcow2::header*)sp.data();
+
+        if (h.magic == qcow2::MAGIC && can_parse_natively(sp)) {
+            virtual_size = h.size;
+            native = true;
+            load_native(h);
+
+            // relative backing file names are relative to the image
+
+            auto backing_file = qcow2::read_backing_file(sp);
+
+            if (!backing_file.empty()) {
+                auto path = filesystem::path(filename).parent_path() / backing_file;
+
+                backing = open_backing(path.string(), qcow2::read_backing_format(sp), index_dir);
+            }
+
+            return;
+        }
+    }
+
+    auto info = json::parse(run_command("qemu-img info --output json "s + filename));
+
+    if (info.type() != json::value_t::object)
+        throw runtime_error("JSON was not an object");
+
+    virtual_size = (uint64_t)info.at("virtual-size");
+}
+
+// The allocation map can be cached in an index file, so we can skip parsing
+// the L2 tables again when looking at the same image. It's keyed by the
+// image's size and mtime and by checksums of the header and L1 table, and each
+// L2 table has its own checksum, so that if the image has changed we only need
+// to parse the tables which are different. The rest of the file is covered by
+// a checksum too, so that a damaged index gets thrown away rather than used.
+
+static const uint64_t INDEX_MAGIC = 0x5844494b43534442; // "BDSCKIDX"
+static const uint32_t INDEX_VERSION = 3;
+
+struct index_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t file_size;
+    uint64_t virtual_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t header_crc;
+    uint32_t l1_crc;
+    uint64_t l1_size;
+    uint64_t num_runs;
+    uint32_t l2s_crc;
+    uint32_t runs_crc;
+};
+
+struct index_l2 {
+    uint64_t offset;
+    uint32_t crc;
+    uint32_t padding;
+    uint64_t first_run;
+    uint64_t num_runs;
+};
+
+struct index_run {
+    uint64_t guest_offset;
+    uint64_t length;
+    uint64_t host_offset;
+    qcow2::cluster_state state;
+    uint8_t padding[7];
+};
+
+// Several checks of the same image can be running at once, e.g. of overlays
+// sharing a base, so each writes its own temporary file and renames it.
+static void write_index(const filesystem::path& fn, const index_header& ih,
+                        span<const index_l2> l2s, span<const index_run> runs) {
+    auto tmp = fn.string() + ".XXXXXX";
+
+    auto fd = mkostemp(tmp.data(), O_CLOEXEC);
+    if (fd < 0)
+        throw formatted_error("mkostemp failed (errno {})", errno);
+
+    auto write_all = [fd](span<const uint8_t> sp) {
+        while (!sp.empty()) {
+            auto ret = write(fd, sp.data(), sp.size());
+
+            if (ret < 0)
+                throw formatted_error("write failed (errno {})", errno);
+
+            sp = sp.subspan(ret);
+        }
+    };
+
+    try {
+        write_all(span((const uint8_t*)&ih, sizeof(ih)));
+        write_all(span((const uint8_t*)l2s.data(), l2s.size_bytes()));
+        write_all(span((const uint8_t*)runs.data(), runs.size_bytes()));
+
+        if (fchmod(fd, 0644) == -1)
+            throw formatted_error("fchmod failed (errno {})", errno);
+
+        if (fsync(fd) == -1)
+            throw formatted_error("fsync failed (errno {})", errno);
+    } catch (...) {
+        close(fd);
+        unlink(tmp.c_str());
+        throw;
+    }
+
+    close(fd);
+
+    if (rename(tmp.c_str(), fn.c_str()) < 0) {
+        unlink(tmp.c_str());
+        throw formatted_error("rename failed (errno {})", errno);
+    }
+}
+
+static void add_cluster_runs(map<uint64_t, qcow_map>& qm, span<const qcow2::cluster_run> runs,
+                             uint64_t virtual_size) {
+    auto end = runs.empty() ? 0 : runs.back().guest_offset + runs.back().length;
+
+    if (end < virtual_size)
+        throw runtime_error("qcow2 L1 table too small for image");
+
+    for (const auto& r : runs) {
+        switch (r.state) {
+            case qcow2::cluster_state::unallocated:
+                qm.emplace(r.guest_offset, qcow_map{false, false, true, r.guest_offset, r.length, 0});
+                break;
+
+            case qcow2::cluster_state::zero:
+                qm.emplace(r.guest_offset, qcow_map{false, true, true, r.guest_offset, r.length, 0});
+                break;
+
+            case qcow2::cluster_state::data:
+                qm.emplace(r.guest_offset, qcow_map{true, true, false, r.guest_offset, r.length,
+                                                    r.host_offset});
+                break;
+        }
+    }
+}
+
+void qcow::load_native(const qcow2::header& h) {
+    auto file = mmap.get_span();
+    uint32_t cluster_bits = h.cluster_bits;
+    auto cluster_size = (uint64_t)1 << cluster_bits;
+    uint64_t l1_size = h.l1_size;
+    uint64_t l1_offset = h.l1_table_offset;
+    auto l2_coverage = (cluster_size / sizeof(uint64_t)) * cluster_size;
+
+    if (l1_offset + (l1_size * sizeof(uint64_t)) > file.size())
+        throw runtime_error("qcow2 L1 table goes beyond end of file");
+
+    auto l1 = span((const qcow2::big_endian<uint64_t>*)(file.data() + l1_offset), l1_size);
+
+    struct stat st;
+
+    if (stat(filename.c_str(), &st) == -1)
+        throw formatted_error("stat failed (errno {})", errno);
+
+    index_header ih;
+
+    memset(&ih, 0, sizeof(ih));
+    ih.magic = INDEX_MAGIC;
+    ih.version = INDEX_VERSION;
+    ih.cluster_bits = cluster_bits;
+    ih.file_size = file.size();
+    ih.virtual_size = virtual_size;
+    ih.mtime_sec = st.st_mtim.tv_sec;
+    ih.mtime_nsec = st.st_mtim.tv_nsec;
+    ih.header_crc = btrfs::crc32c(file.subspan(0, min(cluster_size, (uint64_t)file.size())));
+    ih.l1_crc = btrfs::crc32c(span((const uint8_t*)l1.data(), l1.size_bytes()));
+    ih.l1_size = l1_size;
+
+    // see if we have an index from last time - it's named after the image's
+    // full path, so that images with the same name in different directories
+    // don't share one
+
+    filesystem::path index_fn;
+    optional<mapping> old;
+    const index_header* oh = nullptr;
+    span<const index_l2> old_l2s;
+    span<const index_run> old_runs;
+
+    if (!index_dir.empty()) {
+        auto path = filesystem::weakly_canonical(filename);
+        auto& ps = path.native();
+
+        index_fn = index_dir / format("{}.{:08x}.discard-index", path.filename().string(),
+                                      btrfs::crc32c(span((const uint8_t*)ps.data(), ps.size())));
+
+        try {
+            old.emplace(index_fn.c_str());
+        } catch (...) {
+        }
+    }
+
+    if (old && old->length >= sizeof(index_header)) {
+        auto sp = old->get_span();
+        auto& oih = *(index_header*)sp.data();
+
+        if (oih.magic == INDEX_MAGIC && oih.version == INDEX_VERSION &&
+            oih.cluster_bits == cluster_bits && oih.l1_size <= sp.size() / sizeof(index_l2) &&
+            oih.num_runs <= sp.size() / sizeof(index_run) &&
+            sp.size() == sizeof(index_header) + (oih.l1_size * sizeof(index_l2)) +
+                         (oih.num_runs * sizeof(index_run))) {
+            auto l2s = span((const index_l2*)(sp.data() + sizeof(index_header)), oih.l1_size);
+            auto runs = span((const index_run*)(l2s.data() + l2s.size()), oih.num_runs);
+
+            if (btrfs::crc32c(span((const uint8_t*)l2s.data(), l2s.size_bytes())) == oih.l2s_crc &&
+                btrfs::crc32c(span((const uint8_t*)runs.data(), runs.size_bytes())) == oih.runs_crc) {
+                oh = &oih;
+                old_l2s = l2s;
+                old_runs = runs;
+            }
+        }
+    }
+
+    // If nothing has changed, we can trust the old index without looking at
+    // the L2 tables at all.
+    bool unchanged = oh && oh->file_size == ih.file_size &&
+                     oh->virtual_size == ih.virtual_size && oh->mtime_sec == ih.mtime_sec &&
+                     oh->mtime_nsec == ih.mtime_nsec && oh->header_crc == ih.header_crc &&
+                     oh->l1_crc == ih.l1_crc && oh->l1_size == ih.l1_size;
+
+    vector<index_l2> l2s(l1_size);
+    vector<index_run> runs;
+    vector<qcow2::cluster_run> all;
+
+    for (uint64_t i = 0; i < l1_size; i++) {
+        auto guest = i * l2_coverage;
+
+        if (guest >= virtual_size)
+            break;
+
+        auto l2_offset = l1[i] & qcow2::L1E_OFFSET_MASK;
+        span<const uint8_t> table;
+        uint32_t crc = 0;
+        vector<qcow2::cluster_run> l2_runs;
+
+        if (l2_offset != 0) {
+            if (l2_offset + cluster_size > file.size())
+                throw formatted_error("qcow2 L2 table at {:x} goes beyond end of file", l2_offset);
+
+            table = file.subspan(l2_offset, cluster_size);
+
+            if (!index_dir.empty() && !unchanged)
+                crc = btrfs::crc32c(table);
+        }
+
+        // The old runs were cut off at the old virtual size, so if the image
+        // has been resized they're only any good if they still end in the
+        // same place.
+        auto reuse = oh && i < old_l2s.size() && old_l2s[i].offset == l2_offset &&
+                     (unchanged || old_l2s[i].crc == crc) &&
+                     old_l2s[i].num_runs != 0 &&
+                     old_l2s[i].first_run + old_l2s[i].num_runs <= old_runs.size();
+
+        if (reuse && !unchanged) {
+            const auto& last = old_runs[old_l2s[i].first_run + old_l2s[i].num_runs - 1];
+
+            reuse = last.guest_offset + last.length == min(guest + l2_coverage, virtual_size);
+        }
+
+        if (reuse) {
+            crc = old_l2s[i].crc;
+
+            for (const auto& r : old_runs.subspan(old_l2s[i].first_run, old_l2s[i].num_runs)) {
+                l2_runs.emplace_back(r.guest_offset, r.length, r.host_offset, r.state);
+            }
+        } else if (l2_offset == 0) {
+            l2_runs.emplace_back(guest, min(l2_coverage, virtual_size - guest), 0,
+                                 qcow2::cluster_state::unallocated);
+        } else
+            qcow2::parse_l2(table, guest, cluster_bits, virtual_size, l2_runs);
+
+        l2s[i] = { l2_offset, crc, 0, runs.size(), l2_runs.size() };
+
+        for (const auto& r : l2_runs) {
+            runs.push_back({ r.guest_offset, r.length, r.host_offset, r.state, {} });
+            qcow2::add_run(all, r);
+        }
+    }
+
+    if (!index_dir.empty() && !unchanged) {
+        ih.num_runs = runs.size();
+        ih.l2s_crc = btrfs::crc32c(span((const uint8_t*)l2s.data(), l2s.size() * sizeof(index_l2)));
+        ih.runs_crc = btrfs::crc32c(span((const uint8_t*)runs.data(), runs.size() * sizeof(index_run)));
+
+        // not being able to write the index shouldn't stop us
+        try {
+            write_index(index_fn, ih, l2s, runs);
+        } catch (...) {
+        }
+    }
+
+    add_cluster_runs(qm, all, virtual_size);
+
+    loaded[0] = virtual_size;
+}
+
+void qcow::load_map(uint64_t start, uint64_t end) const {
+    vector<pair<uint64_t, uint64_t>> gaps;
+
+    // find the parts of [start, end) we haven't already asked qemu-img about
+
+    auto pos = start;
+    auto it = loaded.upper_bound(start);
+
+    if (it != loaded.begin() && prev(it)->second > pos)
+        pos = prev(it)->second;
+
+    while (pos < end) {
+        auto gap_end = it == loaded.end() ? end : min(it->first, end);
+
+        if (gap_end > pos)
+            gaps.emplace_back(pos, gap_end);
+
+        if (it == loaded.end())
+            break;
+
+        pos = max(pos, it->second);
+        it++;
+    }
+
+    for (const auto& g : gaps) {
+        auto map = get_map(filename, g.first, g.second - g.first);
+
+        for (const auto& m : map) {
+            auto data = (bool)m.at("data");
+            auto present = (bool)m.at("present");
+            auto zero = (bool)m.at("zero");
+            auto start = (uint64_t)m.at("start");
+            auto length = (uint64_t)m.at("length");
+            auto offset = !zero ? (uint64_t)m.at("offset") : 0;
+
+            qm.emplace(start, qcow_map{data, present, zero, start, length, offset});
+        }
+
+        loaded[g.first] = g.second;
+    }
+
+    if (gaps.empty())
+        return;
+
+    // coalesce adjacent ranges
+
+    for (auto it = loaded.begin(); it != loaded.end(); ) {
+        auto next = std::next(it);
+
+        if (next != loaded.end() && next->first <= it->second) {
+            it->second = max(it->second, next->second);
+            loaded.erase(next);
+        } else
+            it++;
+    }
+}
+
+// Copies as much of buf as is covered by the run m, returning how much that was.
+static size_t read_run(const qcow_map& m, span<const uint8_t> file, uint64_t offset,
+                       span<uint8_t> buf) {
+    auto to_copy = min(buf.size(), m.start + m.length - offset);
+
+    if (m.zero)
+        memset(buf.data(), 0, to_copy);
+    else {
+        if (m.offset + offset - m.start + to_copy > file.size())
+            throw formatted_error("qcow cluster at {:x} goes beyond end of file", m.offset);
+
+        memcpy(buf.data(), file.data() + m.offset + offset - m.start, to_copy);
+    }
+
+    return to_copy;
+}
+
+// Returns where [offset, offset + length) is in the file, if the run m covers
+// all of it and it isn't zeroes.
+static span<const uint8_t> map_run(const qcow_map& m, span<const uint8_t> file, uint64_t offset,
+                                   uint64_t length) {
+    if (m.zero || offset + length > m.start + m.length ||
+        m.offset + offset - m.start + length > file.size()) {
+        return {};
+    }
+
+    return file.subspan(m.offset + offset - m.start, length);
+}
+
+static const qcow_map& find_run(const map<uint64_t, qcow_map>& qm, uint64_t offset) {
+    auto it = qm.upper_bound(offset);
+
+    if (it == qm.begin() || prev(it)->second.start + prev(it)->second.length <= offset)
+        throw runtime_error("mappings not contiguous");
+
+    return prev(it)->second;
+}
+
+// Returns the runs of qm covering [start, start + length), cut down to fit.
+static vector<qcow_map> clip_map(const map<uint64_t, qcow_map>& qm, uint64_t start,
+                                 uint64_t length) {
+    vector<qcow_map> ret;
+    auto end = start + length;
+
+    auto it = qm.upper_bound(start);
+
+    if (it != qm.begin())
+        it--;
+
+    while (it != qm.end() && it->second.start < end) {
+        auto m = it->second;
+
+        if (m.start + m.length > start) {
+            if (m.start < start) {
+                if (!m.zero)
+                    m.offset += start - m.start;
+
+                m.length -= start - m.start;
+                m.start = start;
+            }
+
+            if (m.start + m.length > end)
+                m.length = end - m.start;
+
+            ret.push_back(m);
+        }
+
+        it++;
+    }
+
+    return ret;
+}
+
+// Asks the kernel to start reading in the parts of the mapped file holding
+// the data of the runs.
+static void will_need_runs(const vector<qcow_map>& runs, span<const uint8_t> file) {
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+    for (const auto& m : runs) {
+        if (m.zero || m.offset >= file.size())
+            continue;
+
+        auto start = m.offset & ~(page_size - 1);
+        auto end = min(m.offset + m.length, (uint64_t)file.size());
+
+        madvise((void*)(file.data() + start), end - start, MADV_WILLNEED);
+    }
+}
+
+void qcow::will_need(uint64_t offset, uint64_t length) const {
+    vector<qcow_map> layer;
+
+    {
+        lock_guard lg(mut);
+
+        load_map(offset, offset + length);
+
+        layer = clip_map(qm, offset, length);
+    }
+
+    will_need_runs(layer, mmap.get_span());
+
+    if (!backing)
+        return;
+
+    for (const auto& m : layer) {
+        if (!m.present && m.start < backing->size())
+            backing->will_need(m.start, min(m.length, backing->size() - m.start));
+    }
+}
+
+void qcow::read(uint64_t offset, span<uint8_t> buf) const {
+    static const uint64_t WINDOW_SIZE = 0x4000000; // 64 MiB
+
+    auto sp = mmap.get_span();
+
+    {
+        lock_guard lg(mut);
+
+        load_map(offset & ~(WINDOW_SIZE - 1),
+                 min(virtual_size, (offset + buf.size() + WINDOW_SIZE - 1) & ~(WINDOW_SIZE - 1)));
+    }
+
+    while (!buf.empty()) {
+        qcow_map m;
+
+        {
+            lock_guard lg(mut);
+
+            m = find_run(qm, offset);
+        }
+
+        size_t copied;
+
+        if (backing && !m.present)
+            copied = read_backing(offset, buf.subspan(0, min(buf.size(), m.start + m.length - offset)));
+        else
+            copied = read_run(m, sp, offset, buf);
+
+        offset += copied;
+        buf = buf.subspan(copied);
+    }
+}
+
+span<const uint8_t> qcow::mapped(uint64_t offset, uint64_t length) const {
+    qcow_map m;
+
+    {
+        lock_guard lg(mut);
+
+        load_map(offset, min(virtual_size, offset + length));
+
+        m = find_run(qm, offset);
+    }
+
+    if (backing && !m.present) {
+        if (offset + length > m.start + m.length || offset + length > backing->size())
+            return {};
+
+        return backing->mapped(offset, length);
+    }
+
+    return map_run(m, mmap.get_span(), offset, length);
+}
+
+// Reads the part of the image which this layer leaves to its backing file.
+// Anything beyond the end of the backing file reads as zeroes.
+size_t qcow::read_backing(uint64_t offset, span<uint8_t> buf) const {
+    auto backing_size = backing->size();
+    auto in_backing = offset < backing_size ? min((uint64_t)buf.size(), backing_size - offset) : 0;
+
+    if (in_backing != 0)
+        backing->read(offset, buf.subspan(0, in_backing));
+
+    memset(buf.data() + in_backing, 0, buf.size() - in_backing);
+
+    return buf.size();
+}
+
+vector<qcow_map> qcow::alloc_map(uint64_t start, uint64_t length) const {
+    vector<qcow_map> layer;
+
+    {
+        lock_guard lg(mut);
+
+        load_map(start, start + length);
+
+        layer = clip_map(qm, start, length);
+    }
+
+    if (!backing)
+        return layer;
+
+    return with_backing(layer);
+}
+
+// Fills in the parts of this layer's map which aren't allocated with those of
+// the backing file, all the way down the chain. The offsets of these runs are
+// within whichever file they came from.
+vector<qcow_map> qcow::with_backing(const vector<qcow_map>& layer) const {
+    vector<qcow_map> ret;
+    auto backing_size = backing->size();
+
+    for (const auto& m : layer) {
+        if (m.present || m.start >= backing_size) {
+            ret.push_back(m);
+            continue;
+        }
+
+        auto length = min(m.length, backing_size - m.start);
+
+        for (const auto& b : backing->alloc_map(m.start, length)) {
+            ret.push_back(b);
+        }
+
+        if (length < m.length)
+            ret.push_back({ false, false, true, m.start + length, m.length - length, 0 });
+    }
+
+    return ret;
+}
+
+vector<qcow_snapshot_info> qcow::snapshots() const {
+    if (!native)
+        throw runtime_error("cannot read snapshots of this image");
+
+    vector<qcow_snapshot_info> ret;
+
+    for (const auto& s : qcow2::read_snapshots(mmap.get_span())) {
+        ret.emplace_back(s.id, s.name, s.disk_size);
+    }
+
+    return ret;
+}
+
+// Returns the parts of the file which aren't holes.
+static vector<pair<uint64_t, uint64_t>> data_ranges(const string& filename) {
+    vector<pair<uint64_t, uint64_t>> ret;
+
+    auto fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw formatted_error("open failed (errno {})", errno);
+
+    off_t pos = 0;
+
+    while (true) {
+        auto start = lseek(fd, pos, SEEK_DATA);
+
+        if (start < 0) {
+            if (errno == ENXIO) // no more data
+                break;
+
+            auto err = errno;
+            close(fd);
+            throw formatted_error("lseek failed (errno {})", err);
+        }
+
+        auto end = lseek(fd, start, SEEK_HOLE);
+
+        if (end < 0) {
+            auto err = errno;
+            close(fd);
+            throw formatted_error("lseek failed (errno {})", err);
+        }
+
+        ret.emplace_back(start, end - start);
+        pos = end;
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+static uint64_t get_refcount(span<const uint8_t> block, uint64_t index, unsigned int refcount_bits) {
+    switch (refcount_bits) {
+        case 1:
+        case 2:
+        case 4: {
+            auto per_byte = 8 / refcount_bits;
+
+            return (block[index / per_byte] >> ((index % per_byte) * refcount_bits)) &
+                   ((1u << refcount_bits) - 1);
+        }
+
+        case 8:
+            return block[index];
+
+        case 16:
+            return ((const qcow2::big_endian<uint16_t>*)block.data())[index];
+
+        case 32:
+            return ((const qcow2::big_endian<uint32_t>*)block.data())[index];
+
+        default:
+            return ((const qcow2::big_endian<uint64_t>*)block.data())[index];
+    }
+}
+
+static void set_refcount(span<uint8_t> block, uint64_t index, unsigned int refcount_bits,
+                         uint64_t refcount) {
+    switch (refcount_bits) {
+        case 1:
+        case 2:
+        case 4: {
+            auto per_byte = 8 / refcount_bits;
+            auto shift = (index % per_byte) * refcount_bits;
+            auto mask = ((1u << refcount_bits) - 1) << shift;
+
+            block[index / per_byte] = (uint8_t)((block[index / per_byte] & ~mask) | (refcount << shift));
+            break;
+        }
+
+        case 8:
+            block[index] = (uint8_t)refcount;
+            break;
+
+        case 16:
+            ((qcow2::big_endian<uint16_t>*)block.data())[index] = (uint16_t)refcount;
+            break;
+
+        case 32:
+            ((qcow2::big_endian<uint32_t>*)block.data())[index] = (uint32_t)refcount;
+            break;
+
+        default:
+            ((qcow2::big_endian<uint64_t>*)block.data())[index] = refcount;
+            break;
+    }
+}
+
+// Goes through the refcount table and the holes in the host file together, to
+// see how much of the space qcow2 has stopped using has actually been given
+// back to the host filesystem.
+host_usage qcow::host_usage() const {
+    if (!native)
+        throw runtime_error("cannot read refcounts of this image");
+
+    auto file = mmap.get_span();
+    const auto& h = *(qcow2::header*)file.data();
+    auto cluster_size = (uint64_t)1 << h.cluster_bits;
+    unsigned int refcount_bits = 1u << (h.version >= 3 ? (uint32_t)h.refcount_order : 4);
+    auto entries_per_block = (cluster_size * 8) / refcount_bits;
+    uint64_t reftable_offset = h.refcount_table_offset;
+    auto reftable_size = ((uint64_t)h.refcount_table_clusters * cluster_size) / sizeof(uint64_t);
+
+    if (refcount_bits > 64)
+        throw formatted_error("invalid qcow2 refcount width {}", refcount_bits);
+
+    if (reftable_offset + (reftable_size * sizeof(uint64_t)) > file.size())
+        throw runtime_error("qcow2 refcount table goes beyond end of file");
+
+    auto reftable = span((const qcow2::big_endian<uint64_t>*)(file.data() + reftable_offset),
+                         reftable_size);
+    auto data = data_ranges(filename);
+    discard_check::host_usage ret;
+    size_t d = 0;
+
+    ret.file_size = file.size();
+
+    for (const auto& r : data) {
+        ret.allocated_bytes += r.second;
+    }
+
+    for (uint64_t cluster = 0; cluster * cluster_size < file.size(); cluster++) {
+        auto start = cluster * cluster_size;
+        auto end = min(start + cluster_size, (uint64_t)file.size());
+        auto block_index = cluster / entries_per_block;
+        uint64_t refcount = 0;
+
+        if (block_index < reftable.size()) {
+            auto block_offset = reftable[block_index] & qcow2::REFT_OFFSET_MASK;
+
+            if (block_offset != 0) {
+                if (block_offset + cluster_size > file.size())
+                    throw formatted_error("qcow2 refcount block at {:x} goes beyond end of file", block_offset);
+
+                refcount = get_refcount(file.subspan(block_offset, cluster_size),
+                                        cluster % entries_per_block, refcount_bits);
+            }
+        }
+
+        if (refcount != 0) {
+            ret.referenced_bytes += end - start;
+            continue;
+        }
+
+        ret.unreferenced_bytes += end - start;
+
+        // work out how much of the cluster is still data in the host file
+
+        while (d < data.size() && data[d].first + data[d].second <= start) {
+            d++;
+        }
+
+        uint64_t in_use = 0;
+
+        for (auto i = d; i < data.size() && data[i].first < end; i++) {
+            in_use += min(end, data[i].first + data[i].second) - max(start, data[i].first);
+        }
+
+        ret.unreclaimed_bytes += in_use;
+        ret.reclaimed_bytes += (end - start) - in_use;
+    }
+
+    return ret;
+}
+
+// Marks the whole clusters within ranges as unallocated, dropping their
+// refcounts and punching them out of the host file. Each L2 table and refcount
+// block is written once, and the allocation map is re-read afterwards. Returns
+// how many bytes were discarded.
+uint64_t qcow::discard(span<const pair<uint64_t, uint64_t>> ranges) {
+    if (!native)
+        throw runtime_error("cannot fix this image");
+
+    auto file = mmap.get_span();
+    const auto& h = *(qcow2::header*)file.data();
+
+    if (h.version >= 3 && h.incompatible_features & qcow2::INCOMPAT_DIRTY)
+        throw runtime_error("image refcounts are dirty, run qemu-img check -r all first");
+
+    // Clearing the L2 entry of an overlay would uncover what's in the backing
+    // file, so mark the cluster as reading as zeroes instead, which needs v3.
+
+    if (backing && h.version < 3)
+        throw runtime_error("cannot fix a version 2 image with a backing file");
+
+    uint64_t new_entry = backing ? qcow2::OFLAG_ZERO : 0;
+
+    uint32_t cluster_bits = h.cluster_bits;
+    auto cluster_size = (uint64_t)1 << cluster_bits;
+    auto l2_entries = cluster_size / sizeof(uint64_t);
+    uint64_t l1_offset = h.l1_table_offset;
+    uint64_t l1_size = h.l1_size;
+    unsigned int refcount_bits = 1u << (h.version >= 3 ? (uint32_t)h.refcount_order : 4);
+    auto entries_per_block = (cluster_size * 8) / refcount_bits;
+    uint64_t reftable_offset = h.refcount_table_offset;
+    auto reftable_size = ((uint64_t)h.refcount_table_clusters * cluster_size) / sizeof(uint64_t);
+
+    if (refcount_bits > 64)
+        throw formatted_error("invalid qcow2 refcount width {}", refcount_bits);
+
+    if (l1_offset + (l1_size * sizeof(uint64_t)) > file.size())
+        throw runtime_error("qcow2 L1 table goes beyond end of file");
+
+    if (reftable_offset + (reftable_size * sizeof(uint64_t)) > file.size())
+        throw runtime_error("qcow2 refcount table goes beyond end of file");
+
+    auto l1 = span((const qcow2::big_endian<uint64_t>*)(file.data() + l1_offset), l1_size);
+    auto reftable = span((const qcow2::big_endian<uint64_t>*)(file.data() + reftable_offset),
+                         reftable_size);
+
+    auto fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        throw formatted_error("open failed (errno {})", errno);
+
+    // qemu takes OFD locks on the image while it's using it
+
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+
+    if (fcntl(fd, F_OFD_SETLK, &fl) == -1) {
+        close(fd);
+        throw runtime_error("image is in use");
+    }
+
+    map<uint64_t, vector<uint8_t>> l2_tables, refcount_blocks;
+    vector<pair<uint64_t, uint64_t>> holes;
+    uint64_t discarded = 0;
+
+    auto load_cluster = [&](map<uint64_t, vector<uint8_t>>& m, uint64_t offset) -> vector<uint8_t>& {
+        auto& v = m[offset];
+
+        if (v.empty()) {
+            if (offset + cluster_size > file.size())
+                throw formatted_error("qcow2 metadata at {:x} goes beyond end of file", offset);
+
+            v.assign(file.begin() + offset, file.begin() + offset + cluster_size);
+        }
+
+        return v;
+    };
+
+    try {
+        for (const auto& [start, length] : ranges) {
+            auto first = (start + cluster_size - 1) >> cluster_bits;
+            auto last = (start + length) >> cluster_bits;
+
+            for (auto c = first; c < last; c++) {
+                if (c / l2_entries >= l1.size())
+                    break;
+
+                uint64_t l1e = l1[c / l2_entries];
+                auto l2_offset = l1e & qcow2::L1E_OFFSET_MASK;
+
+                // Leave alone anything shared with a snapshot, i.e. where
+                // the refcount isn't 1.
+                if (l2_offset == 0 || !(l1e & qcow2::OFLAG_COPIED))
+                    continue;
+
+                auto& table = load_cluster(l2_tables, l2_offset);
+                auto& entry = ((qcow2::big_endian<uint64_t>*)table.data())[c % l2_entries];
+                uint64_t e = entry;
+                auto host = e & qcow2::L2E_OFFSET_MASK;
+
+                if (host == 0 || (e & qcow2::OFLAG_COMPRESSED) || !(e & qcow2::OFLAG_COPIED))
+                    continue;
+
+                auto block_index = (host >> cluster_bits) / entries_per_block;
+
+                if (block_index >= reftable.size())
+                    throw formatted_error("no refcount block for cluster at {:x}", host);
+
+                auto block_offset = reftable[block_index] & qcow2::REFT_OFFSET_MASK;
+
+                if (block_offset == 0)
+                    throw formatted_error("no refcount block for cluster at {:x}", host);
+
+                auto& block = load_cluster(refcount_blocks, block_offset);
+                auto index = (host >> cluster_bits) % entries_per_block;
+
+                if (get_refcount(block, index, refcount_bits) != 1) {
+                    throw formatted_error("cluster at {:x} has refcount {}, expected 1", host,
+                                          get_refcount(block, index, refcount_bits));
+                }
+
+                entry = new_entry;
+                set_refcount(block, index, refcount_bits, 0);
+
+                holes.emplace_back(host, cluster_size);
+                discarded += cluster_size;
+            }
+        }
+
+        // Make sure the L2 tables are on disk before the refcounts, so that if
+        // we crash in between clusters are leaked rather than used twice, and
+        // that the refcounts are before we punch out the data.
+
+        for (const auto& [offset, v] : l2_tables) {
+            if (pwrite(fd, v.data(), v.size(), offset) != (ssize_t)v.size())
+                throw formatted_error("pwrite failed (errno {})", errno);
+        }
+
+        if (fdatasync(fd) == -1)
+            throw formatted_error("fdatasync failed (errno {})", errno);
+
+        for (const auto& [offset, v] : refcount_blocks) {
+            if (pwrite(fd, v.data(), v.size(), offset) != (ssize_t)v.size())
+                throw formatted_error("pwrite failed (errno {})", errno);
+        }
+
+        if (fdatasync(fd) == -1)
+            throw formatted_error("fdatasync failed (errno {})", errno);
+
+        sort(holes.begin(), holes.end());
+
+        for (size_t i = 0; i < holes.size(); ) {
+            auto start = holes[i].first;
+            auto end = start + holes[i].second;
+
+            for (i++; i < holes.size() && holes[i].first == end; i++) {
+                end += holes[i].second;
+            }
+
+            // not every filesystem can punch holes, but the clusters are free either way
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == -1 &&
+                errno != EOPNOTSUPP) {
+                throw formatted_error("fallocate failed (errno {})", errno);
+            }
+        }
+
+        if (fsync(fd) == -1)
+            throw formatted_error("fsync failed (errno {})", errno);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+
+    reload();
+
+    return discarded;
+}
+
+// Throws away what we know about the allocation map, after the image has been
+// changed underneath us.
+void qcow::reload() {
+    lock_guard lg(mut);
+
+    qm.clear();
+    loaded.clear();
+
+    {
+        lock_guard lg2(l2_cache_mutex);
+
+        l2_cache.clear();
+    }
+
+    if (native)
+        load_native(*(qcow2::header*)mmap.get_span().data());
+}
+
+// L2 tables are shared between snapshots until one of them is written to,
+// so keep hold of the ones we've parsed. The same table can only be shared at
+// the same guest offset, but key on both to be safe.
+const vector<qcow2::cluster_run>& qcow::cached_l2(uint64_t l2_offset, uint64_t guest) const {
+    shared_ptr<l2_cache_entry> e;
+
+    {
+        lock_guard lg(l2_cache_mutex);
+
+        auto& p = l2_cache[make_pair(l2_offset, guest)];
+
+        if (!p)
+            p = make_shared<l2_cache_entry>();
+
+        e = p;
+    }
+
+    call_once(e->once, [&]() {
+        auto file = mmap.get_span();
+        uint32_t cluster_bits = ((qcow2::header*)file.data())->cluster_bits;
+        auto cluster_size = (uint64_t)1 << cluster_bits;
+        auto l2_coverage = (cluster_size / sizeof(uint64_t)) * cluster_size;
+
+        if (l2_offset + cluster_size > file.size())
+            throw formatted_error("qcow2 L2 table at {:x} goes beyond end of file", l2_offset);
+
+        // snapshots can be different sizes, so the caller cuts this down to fit
+        qcow2::parse_l2(file.subspan(l2_offset, cluster_size), guest, cluster_bits,
+                        guest + l2_coverage, e->runs);
+    });
+
+    return e->runs;
+}
+
+qcow_snapshot::qcow_snapshot(const qcow& q, size_t index) {
+    if (!q.native || q.backing)
+        throw runtime_error("cannot read snapshots of this image");
+
+    file = q.mmap.get_span();
+
+    const auto& h = *(qcow2::header*)file.data();
+    auto snaps = qcow2::read_snapshots(file);
+
+    if (index >= snaps.size())
+        throw formatted_error("snapshot {} out of range", index);
+
+    const auto& snap = snaps[index];
+    auto cluster_size = (uint64_t)1 << h.cluster_bits;
+    auto l2_coverage = (cluster_size / sizeof(uint64_t)) * cluster_size;
+    uint64_t l1_size = snap.l1_size;
+
+    virtual_size = snap.disk_size;
+
+    if (snap.l1_table_offset + (l1_size * sizeof(uint64_t)) > file.size())
+        throw runtime_error("qcow2 snapshot L1 table goes beyond end of file");
+
+    auto l1 = span((const qcow2::big_endian<uint64_t>*)(file.data() + snap.l1_table_offset), l1_size);
+    vector<qcow2::cluster_run> runs;
+
+    for (uint64_t i = 0; i < l1_size; i++) {
+        auto guest = i * l2_coverage;
+
+        if (guest >= virtual_size)
+            break;
+
+        auto l2_offset = l1[i] & qcow2::L1E_OFFSET_MASK;
+
+        if (l2_offset == 0) {
+            qcow2::add_run(runs, { guest, min(l2_coverage, virtual_size - guest), 0,
+                                   qcow2::cluster_state::unallocated });
+            continue;
+        }
+
+        for (auto r : q.cached_l2(l2_offset, guest)) {
+            if (r.guest_offset >= virtual_size)
+                break;
+
+            r.length = min(r.length, virtual_size - r.guest_offset);
+
+            qcow2::add_run(runs, r);
+        }
+    }
+
+    add_cluster_runs(qm, runs, virtual_size);
+}
+
+void mapped_image::read(uint64_t offset, span<uint8_t> buf) const {
+    while (!buf.empty()) {
+        auto copied = read_run(find_run(qm, offset), file, offset, buf);
+
+        offset += copied;
+        buf = buf.subspan(copied);
+    }
+}
+
+vector<qcow_map> mapped_image::alloc_map(uint64_t start, uint64_t length) const {
+    return clip_map(qm, start, length);
+}
+
+void mapped_image::will_need(uint64_t offset, uint64_t length) const {
+    will_need_runs(clip_map(qm, offset, length), file);
+}
+
+span<const uint8_t> mapped_image::mapped(uint64_t offset, uint64_t length) const {
+    return map_run(find_run(qm, offset), file, offset, length);
+}
+
+// Appends a run to the map, joining it to the previous one if it carries straight on.
+void mapped_image::add_run(const qcow_map& m) {
+    if (!qm.empty()) {
+        auto& l = qm.rbegin()->second;
+
+        if (l.data == m.data && l.present == m.present && l.zero == m.zero &&
+            l.start + l.length == m.start && (!m.data || l.offset + l.length == m.offset)) {
+            l.length += m.length;
+            return;
+        }
+    }
+
+    qm.emplace(m.start, m);
+}
+
+static const pair<uint64_t, const chunk&> find_chunk(const chunk_table& chunks,
+                                                     uint64_t address) {
+    auto it = chunks.find_containing(address);
+
+    if (it == chunks.end())
+        throw formatted_error("could not find address {:x} in chunks", address);
+
+    return *it;
+}
+
+template<typename T>
+concept walk_func = requires(T t) {
+    is_invocable_v<T, const btrfs::key&, span<const uint8_t>>;
+    { t(*(btrfs::key*)nullptr, span<const uint8_t>()) } -> same_as<bool>;
+};
+
+// for trees whose blocks can belong to others, i.e. snapshots
+static const uint64_t ANY_OWNER = 0;
+
+static vector<uint8_t> read_node(const image& q, const btrfs::super_block& sb, uint64_t address,
+                                 uint8_t exp_level, uint64_t exp_generation,
+                                 uint64_t exp_owner, const chunk_table& chunks);
+
+static btrfs::node_reader tree_reader(const image& q, const btrfs::super_block& sb,
+                                      uint64_t owner, const chunk_table& chunks) {
+    return [&q, &sb, owner, &chunks](uint64_t address, uint8_t level, uint64_t generation) {
+        return read_node(q, sb, address, level, generation, owner, chunks);
+    };
+}
+
+static uint64_t resolve_remap(const image& q, const btrfs::super_block& sb,
+                              uint64_t address, const chunk_table& chunks) {
+    btrfs::tree_cursor c(tree_reader(q, sb, btrfs::REMAP_TREE_OBJECTID, chunks),
+                         sb.remap_root, sb.remap_root_level, sb.remap_root_generation);
+
+    // find the last REMAP or IDENTITY_REMAP starting at or before address
+
+    btrfs::key search_key = { address, (btrfs::key_type)0xff, 0xffffffffffffffff };
+
+    c.search(search_key);
+
+    if (!c.prev())
+        throw formatted_error("could not resolve remap for address {:x}", address);
+
+    while (c.item_key().type != btrfs::key_type::REMAP &&
+           c.item_key().type != btrfs::key_type::IDENTITY_REMAP) {
+        if (!c.prev())
+            throw formatted_error("could not resolve remap for address {:x}", address);
+    }
+
+    const auto& key = c.item_key();
+
+    if (key.objectid + key.offset <= address)
+        throw formatted_error("could not resolve remap for address {:x}", address);
+
+    if (key.type == btrfs::key_type::IDENTITY_REMAP)
+        return address;
+
+    auto sp = c.item_data();
+
+    if (sp.size() < sizeof(btrfs::remap)) {
+        throw formatted_error("REMAP was {} bytes, expected {}",
+                              sp.size(), sizeof(btrfs::remap));
+    }
+
+    const auto& r = *(btrfs::remap*)sp.data();
+
+    return address - key.objectid + r.address;
+}
+
+static uint64_t get_physical_address(const image& q, const btrfs::super_block& sb,
+                                     uint64_t address, const chunk_table& chunks) {
+    auto& [chunk_start, c] = find_chunk(chunks, address);
+
+    if (c.type & btrfs::BLOCK_GROUP_REMAPPED)
+        return get_physical_address(q, sb, resolve_remap(q, sb, address, chunks), chunks);
+
+    switch (btrfs::get_chunk_raid_type(c)) {
+        case btrfs::raid_type::RAID0:
+        case btrfs::raid_type::RAID10:
+        case btrfs::raid_type::RAID5:
+        case btrfs::raid_type::RAID6:
+            throw formatted_error("unsupported RAID type {}", btrfs::get_chunk_raid_type(c));
+
+        default:
+            break;
+    }
+
+    return address - chunk_start + c.stripe[0].offset;
+}
+
+// A validated tree block. If the image is mapped, data points straight into
+// it; otherwise the block is read into buf, and data points to that.
+struct tree_block {
+    vector<uint8_t> buf;
+    span<const uint8_t> data;
+
+    const btrfs::header& header() const {
+        return *(const btrfs::header*)data.data();
+    }
+};
+
+static tree_block read_tree_block(const image& q, const btrfs::super_block& sb, uint64_t address,
+                                  uint8_t exp_level, uint64_t exp_generation,
+                                  uint64_t exp_owner, const chunk_table& chunks) {
+    tree_block tb;
+
+    auto phys_address = get_physical_address(q, sb, address, chunks);
+
+    tb.data = q.mapped(phys_address, sb.nodesize);
+
+    if (tb.data.empty()) {
+        tb.buf.resize(sb.nodesize);
+        q.read(phys_address, tb.buf);
+        tb.data = tb.buf;
+    }
+
+    auto& h = tb.header();
+
+    if (!btrfs::check_tree_csum(h, sb)) {
+        throw formatted_error("csum error while reading tree block at {:x}",
+                              address);
+    }
+
+    if (h.bytenr != address) {
+        throw formatted_error("tree address header mismatch ({:x}, expected {:x})",
+                              (uint64_t)h.bytenr, address);
+    }
+
+    if (h.level != exp_level) {
+        throw formatted_error("tree block at {:x} had level {}, expected {}",
+                              address, h.level, exp_level);
+    }
+
+    if (h.generation != exp_generation) {
+        throw formatted_error("tree block at {:x} had generation {:x}, expected {:x}",
+                              address, (uint64_t)h.generation, exp_generation);
+    }
+
+    if (exp_owner != ANY_OWNER && h.owner != exp_owner) {
+        throw formatted_error("tree block at {:x} had owner {:x}, expected {:x}",
+                              address, (uint64_t)h.owner, exp_owner);
+    }
+
+    return tb;
+}
+
+// As read_tree_block, but always returning a copy, for tree_cursor.
+static vector<uint8_t> read_node(const image& q, const btrfs::super_block& sb, uint64_t address,
+                                 uint8_t exp_level, uint64_t exp_generation,
+                                 uint64_t exp_owner, const chunk_table& chunks) {
+    auto tb = read_tree_block(q, sb, address, exp_level, exp_generation, exp_owner, chunks);
+
+    if (!tb.buf.empty())
+        return move(tb.buf);
+
+    return vector<uint8_t>(tb.data.begin(), tb.data.end());
+}
+
+template<btrfs::key_type... Types>
+static bool key_type_matches(btrfs::key_type type) {
+    if constexpr (sizeof...(Types) == 0)
+        return true;
+    else
+        return ((type == Types) || ...);
+}
+
+// Returns whether a subtree with keys from first up to but not including
+// last could contain any of Types. If first and last have the same objectid,
+// the only types it can contain are the ones between theirs.
+template<btrfs::key_type... Types>
+static bool subtree_may_match(const btrfs::key& first, const btrfs::key* last) {
+    if constexpr (sizeof...(Types) == 0)
+        return true;
+    else {
+        if (!last || last->objectid != first.objectid)
+            return true;
+
+        return ((Types >= first.type && Types <= last->type) || ...);
+    }
+}
+
+// Walks the items of a tree with keys between min_key and max_key inclusive,
+// and with one of Types (or any type if Types is empty), without reading
+// subtrees which can't contain any.
+template<btrfs::key_type... Types>
+static bool walk_tree_range(const image& q, const btrfs::super_block& sb, uint64_t address,
+                            uint8_t exp_level, uint64_t exp_generation,
+                            uint64_t exp_owner, const chunk_table& chunks,
+                            const btrfs::key& min_key, const btrfs::key& max_key,
+                            walk_func auto func) {
+    auto tb = read_tree_block(q, sb, address, exp_level, exp_generation, exp_owner, chunks);
+    auto& h = tb.header();
+
+    if (h.level > 0) {
+        span items((const btrfs::key_ptr*)(tb.data.data() + sizeof(btrfs::header)),
+                   h.nritems);
+
+        for (size_t i = 0; i < items.size(); i++) {
+            // child i contains the keys from items[i].key up to but not including items[i + 1].key
+
+            if (i + 1 < items.size() && items[i + 1].key <= min_key)
+                continue;
+
+            if (items[i].key > max_key)
+                break;
+
+            if (!subtree_may_match<Types...>(items[i].key, i + 1 < items.size() ? &items[i + 1].key : nullptr))
+                continue;
+
+            if (!walk_tree_range<Types...>(q, sb, items[i].blockptr, exp_level - 1, items[i].generation,
+                                           exp_owner, chunks, min_key, max_key, func)) {
+                return false;
+            }
+        }
+
+        return true;
+    } else {
+        span items((const btrfs::item*)(tb.data.data() + sizeof(btrfs::header)), h.nritems);
+
+        for (const auto& it : items) {
+            if (it.key < min_key)
+                continue;
+
+            if (it.key > max_key)
+                break;
+
+            if (!key_type_matches<Types...>(it.key.type))
+                continue;
+
+            auto sp = tb.data.subspan(sizeof(btrfs::header) + it.offset, it.size);
+
+            if (!func(it.key, sp))
+                return false;
+        }
+
+        return true;
+    }
+}
+
+template<btrfs::key_type... Types>
+static bool walk_tree(const image& q, const btrfs::super_block& sb, uint64_t address,
+                      uint8_t exp_level, uint64_t exp_generation,
+                      uint64_t exp_owner, const chunk_table& chunks,
+                      walk_func auto func) {
+    static const btrfs::key min_key = { 0, (btrfs::key_type)0, 0 };
+    static const btrfs::key max_key = { 0xffffffffffffffff, (btrfs::key_type)0xff, 0xffffffffffffffff };
+
+    return walk_tree_range<Types...>(q, sb, address, exp_level, exp_generation, exp_owner, chunks,
+                                     min_key, max_key, func);
+}
+
+template<typename T>
+concept find_item_func = is_invocable_v<T, span<const uint8_t>>;
+
+static bool find_item(const image& q, const btrfs::super_block& sb, uint64_t address,
+                      uint8_t exp_level, uint64_t exp_generation,
+                      uint64_t exp_owner, const chunk_table& chunks,
+                      const btrfs::key& search_key, find_item_func auto func) {
+    btrfs::tree_cursor c(tree_reader(q, sb, exp_owner, chunks), address, exp_level,
+                         exp_generation);
+
+    if (!c.search(search_key))
+        return false;
+
+    func(c.item_data());
+
+    return true;
+}
+
+static chunk_table load_chunks(const image& q, const btrfs::super_block& sb) {
+    map<uint64_t, chunk> sys_chunks, chunks;
+
+    auto sys_array = span(sb.sys_chunk_array.data(), sb.sys_chunk_array_size);
+
+    while (!sys_array.empty()) {
+        if (sys_array.size() < sizeof(btrfs::key))
+            throw runtime_error("sys array truncated");
+
+        auto& k = *(btrfs::key*)sys_array.data();
+
+        if (k.type != btrfs::key_type::CHUNK_ITEM)
+            throw formatted_error("unexpected key type {} in sys array", k.type);
+
+        sys_array = sys_array.subspan(sizeof(btrfs::key));
+
+        if (sys_array.size() < offsetof(btrfs::chunk, stripe))
+            throw runtime_error("sys array truncated");
+
+        auto& c = *(chunk*)sys_array.data();
+
+        if (sys_array.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)))
+            throw runtime_error("sys array truncated");
+
+        if (c.num_stripes > MAX_STRIPES) {
+            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
+                                  (uint16_t)c.num_stripes, MAX_STRIPES);
+        }
+
+        sys_array = sys_array.subspan(offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
+
+        sys_chunks.insert(make_pair((uint64_t)k.offset, c));
+    }
+
+    static const btrfs::key min_key = { btrfs::FIRST_CHUNK_TREE_OBJECTID, btrfs::key_type::CHUNK_ITEM, 0 };
+    static const btrfs::key max_key = { btrfs::FIRST_CHUNK_TREE_OBJECTID, btrfs::key_type::CHUNK_ITEM, 0xffffffffffffffff };
+
+    walk_tree_range<btrfs::key_type::CHUNK_ITEM>(q, sb, sb.chunk_root, sb.chunk_root_level,
+                                                 sb.chunk_root_generation, btrfs::CHUNK_TREE_OBJECTID,
+                                                 chunk_table(sys_chunks), min_key, max_key,
+                                                 [&chunks](const btrfs::key& k, span<const uint8_t> sp) {
+        if (sp.size() < offsetof(btrfs::chunk, stripe)) {
+            throw formatted_error("CHUNK_ITEM truncated ({} bytes, expected at least {})",
+                                  sp.size(), offsetof(btrfs::chunk, stripe));
+        }
+
+        auto& c = *(chunk*)sp.data();
+
+        if (sp.size() < offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe))) {
+            throw formatted_error("CHUNK_ITEM truncated ({} bytes, expected {})",
+                                  sp.size(), offsetof(btrfs::chunk, stripe) + (c.num_stripes * sizeof(btrfs::stripe)));
+        }
+
+        if (c.num_stripes > MAX_STRIPES) {
+            throw formatted_error("chunk num_stripes is {}, maximum supported is {}",
+                                  (uint16_t)c.num_stripes, MAX_STRIPES);
+        }
+
+        chunks.insert(make_pair((uint64_t)k.offset, c));
+
+        return true;
+    });
+
+    return chunks;
+}
+
+enum class btrfs_alloc {
+    unallocated,
+    superblock,
+    chunk,
+    chunk_used,
+    chunk_free
+};
+
+template<>
+struct std::formatter<enum btrfs_alloc> {
+    constexpr auto parse(format_parse_context& ctx) {
+        auto it = ctx.begin();
+
+        if (it != ctx.end() && *it != '}')
+            throw format_error("invalid format");
+
+        return it;
+    }
+
+    template<typename format_context>
+    auto format(enum btrfs_alloc t, format_context& ctx) const {
+        switch (t) {
+            case btrfs_alloc::unallocated:
+                return format_to(ctx.out(), "unallocated");
+            case btrfs_alloc::superblock:
+                return format_to(ctx.out(), "superblock");
+            case btrfs_alloc::chunk:
+                return format_to(ctx.out(), "chunk");
+            case btrfs_alloc::chunk_used:
+                return format_to(ctx.out(), "chunk_used");
+            case btrfs_alloc::chunk_free:
+                return format_to(ctx.out(), "chunk_free");
+            default:
+                return format_to(ctx.out(), "{}", (unsigned int)t);
+        }
+    }
+};
+
+struct btrfs_extent {
+    uint64_t offset;
+    uint64_t length;
+    enum btrfs_alloc alloc;
+    uint64_t address;
+};
+
+struct qcow_extent {
+    uint64_t offset;
+    uint64_t length;
+    bool alloc;
+};
+
+struct extent2 {
+    uint64_t offset;
+    uint64_t length;
+    bool qcow_alloc;
+    enum btrfs_alloc btrfs_alloc;
+    uint64_t address;
+};
+
+static void carve_out_superblocks(pmr::vector<btrfs_extent>& extents) {
+    pmr::vector<btrfs_extent> ret(extents.get_allocator());
+
+    for (const auto& e : extents) {
+        bool superblock_added = false;
+
+        for (auto addr : btrfs::superblock_addrs) {
+            if (addr >= e.offset && addr + sizeof(btrfs::super_block) <= e.offset + e.length) {
+                if (addr > e.offset) {
+                    ret.emplace_back(e.offset, addr - e.offset, e.alloc,
+                                     e.address);
+                }
+
+                ret.emplace_back(addr, sizeof(btrfs::super_block),
+                                 btrfs_alloc::superblock,
+                                 e.alloc == btrfs_alloc::unallocated ? 0 : e.address + addr - e.offset);
+
+                if (e.offset + e.length > addr + sizeof(btrfs::super_block) ) {
+                    ret.emplace_back(addr + sizeof(btrfs::super_block),
+                                     e.offset + e.length - addr - sizeof(btrfs::super_block),
+                                     e.alloc, e.address + addr + sizeof(btrfs::super_block) - e.offset);
+                }
+
+                superblock_added = true;
+                break;
+            }
+        }
+
+        if (!superblock_added)
+            ret.push_back(move(e));
+    }
+
+    extents.swap(ret);
+}
+
+static void add_qcow_extents(pmr::vector<qcow_extent>& qcow_extents,
+                             const vector<qcow_map>& qm) {
+    for (const auto& m : qm) {
+        if (!qcow_extents.empty() &&
+            qcow_extents.back().offset + qcow_extents.back().length == m.start &&
+            !!qcow_extents.back().alloc == !m.zero) {
+            qcow_extents.back().length += m.length;
+        } else
+            qcow_extents.emplace_back(m.start, m.length, !m.zero);
+    }
+}
+
+static pmr::vector<extent2> merge_extents(pmr::vector<btrfs_extent>& extents,
+                                          pmr::vector<qcow_extent>& qcow_extents) {
+    pmr::vector<extent2> merged(extents.get_allocator());
+
+    size_t i = 0, j = 0;
+    while (i < extents.size() && j < qcow_extents.size()) {
+        auto& be = extents[i];
+        auto& qe = qcow_extents[j];
+
+        if (be.length == qe.length) {
+            merged.emplace_back(be.offset, be.length, qe.alloc, be.alloc,
+                                be.address);
+            i++;
+            j++;
+        } else if (be.length < qe.length) {
+            merged.emplace_back(be.offset, be.length, qe.alloc, be.alloc,
+                                be.address);
+            qe.offset += be.length;
+            qe.length -= be.length;
+            i++;
+        } else {
+            merged.emplace_back(be.offset, qe.length, qe.alloc, be.alloc,
+                                be.address);
+            be.offset += qe.length;
+            be.length -= qe.length;
+            be.address += qe.length;
+            j++;
+        }
+    }
+
+    return merged;
+}
+
+struct root_info {
+    uint64_t bytenr;
+    uint8_t level;
+    uint64_t generation;
+};
+
+static optional<root_info> find_root(const image& q, const btrfs::super_block& sb,
+                                     const chunk_table& chunks, uint64_t objectid) {
+    root_info ret;
+
+    btrfs::key search_key = { objectid, btrfs::key_type::ROOT_ITEM, 0 };
+
+    if (!find_item(q, sb, sb.root, sb.root_level, sb.generation, btrfs::ROOT_TREE_OBJECTID,
+                   chunks, search_key, [&ret](span<const uint8_t> sp) {
+        if (sp.size() < sizeof(btrfs::root_item)) {
+            throw formatted_error("ROOT_ITEM truncated ({} bytes, expected {})",
+                                  sp.size(), sizeof(btrfs::root_item));
+        }
+
+        auto& ri = *(btrfs::root_item*)sp.data();
+
+        ret.bytenr = (uint64_t)ri.bytenr;
+        ret.level = ri.level;
+        ret.generation = ri.generation;
+    }))
+        return nullopt;
+
+    return ret;
+}
+
+// Compares the dev extents between physical addresses start and end with the
+// qcow map, reporting anything wrong outside of chunks, and returns the rest
+// grouped by chunk.
+static pmr::map<uint64_t, pmr::vector<extent2>> check_dev_tree(const image& q,
+                                                               const chunk_table& chunks,
+                                                               const btrfs::super_block& sb,
+                                                               uint64_t start, uint64_t end,
+                                                               const finding_func& report,
+                                                               pmr::memory_resource* mr) {
+    auto dev_root = find_root(q, sb, chunks, btrfs::DEV_TREE_OBJECTID);
+
+    if (!dev_root)
+        throw runtime_error("ROOT_ITEM for dev tree not found");
+
+    pmr::vector<btrfs_extent> extents(mr);
+    pmr::vector<qcow_extent> qcow_extents(mr);
+
+    static const btrfs::key min_key = { 1, btrfs::key_type::DEV_EXTENT, 0 };
+    static const btrfs::key max_key = { 1, btrfs::key_type::DEV_EXTENT, 0xffffffffffffffff };
+
+    auto pos = start;
+
+    walk_tree_range<btrfs::key_type::DEV_EXTENT>(q, sb, dev_root->bytenr, dev_root->level,
+                                                 dev_root->generation, btrfs::DEV_TREE_OBJECTID,
+                                                 chunks, min_key, max_key,
+                                                 [&extents, &pos, start, end](const btrfs::key& k, span<const uint8_t> sp) {
+        if (sp.size() < sizeof(btrfs::dev_extent)) {
+            throw formatted_error("DEV_EXTENT truncated ({} bytes, expected {})",
+                                  sp.size(), sizeof(btrfs::dev_extent));
+        }
+
+        auto& de = *(btrfs::dev_extent*)sp.data();
+        uint64_t de_end = k.offset + de.length;
+
+        if (k.offset >= end)
+            return false;
+
+        if (de_end <= start)
+            return true;
+
+        auto s = max((uint64_t)k.offset, start);
+        auto e = min(de_end, end);
+
+        if (s > pos)
+            extents.emplace_back(pos, s - pos, btrfs_alloc::unallocated, 0);
+
+        extents.emplace_back(s, e - s, btrfs_alloc::chunk,
+                             de.chunk_offset + s - k.offset);
+
+        pos = e;
+
+        return true;
+    });
+
+    if (pos < end)
+        extents.emplace_back(pos, end - pos, btrfs_alloc::unallocated, 0);
+
+    add_qcow_extents(qcow_extents, q.alloc_map(start, end - start));
+
+    carve_out_superblocks(extents);
+
+    auto merged = merge_extents(extents, qcow_extents);
+
+    pmr::map<uint64_t, pmr::vector<extent2>> by_chunk(mr);
+
+    for (auto& m : merged) {
+        uint64_t chunk_address;
+
+        if (m.btrfs_alloc == btrfs_alloc::chunk || (m.btrfs_alloc == btrfs_alloc::superblock && m.address != 0)) {
+            auto it = chunks.upper_bound(m.address);
+
+            chunk_address = prev(it)->first;
+        } else
+            chunk_address = 0;
+
+        by_chunk[chunk_address].push_back(move(m));
+    }
+
+    for (const auto& bc : by_chunk) {
+        if (bc.first == 0) {
+            for (const auto& m : bc.second) {
+                if (m.btrfs_alloc == btrfs_alloc::superblock && !m.qcow_alloc) {
+                    report({finding_type::superblock_not_allocated, m.offset,
+                            sizeof(btrfs::super_block), 0});
+                } else if (m.btrfs_alloc == btrfs_alloc::unallocated && m.qcow_alloc) {
+                    if (m.offset + m.length <= btrfs::DEVICE_RANGE_RESERVED)
+                        continue;
+
+                    uint64_t offset, length;
+
+                    if (m.offset < btrfs::DEVICE_RANGE_RESERVED) {
+                        offset = btrfs::DEVICE_RANGE_RESERVED;
+                        length = m.offset + m.length - btrfs::DEVICE_RANGE_RESERVED;
+                    } else {
+                        offset = m.offset;
+                        length = m.length;
+                    }
+
+                    report({finding_type::allocated_outside_chunk, offset, length, 0});
+                }
+            }
+        }
+    }
+
+    return by_chunk;
+}
+
+struct space_entry {
+    uint64_t address;
+    uint64_t length;
+    bool alloc;
+};
+
+struct space_entry2 {
+    uint64_t log_address;
+    uint64_t phys_address;
+    uint64_t length;
+    bool alloc;
+};
+
+static void add_fst_item(const btrfs::key& k, span<const uint8_t> sp, uint32_t sectorsize,
+                         auto& free_space) {
+    if (k.type == btrfs::key_type::FREE_SPACE_EXTENT)
+        free_space.emplace_back(k.objectid, k.offset);
+    else if (k.type == btrfs::key_type::FREE_SPACE_BITMAP) {
+        // only join up runs within this bitmap
+        auto first = free_space.size();
+        uint64_t address = k.objectid;
+
+        while (!sp.empty()) {
+            auto num = sp[0];
+
+            for (unsigned int i = 0; i < 8; i++) {
+                if (num & 1) {
+                    if (free_space.size() > first &&
+                        free_space.back().first + free_space.back().second == address) {
+                        free_space.back().second += sectorsize;
+                    } else
+                        free_space.emplace_back(address, sectorsize);
+                }
+
+                address += sectorsize;
+                num >>= 1;
+            }
+
+            sp = sp.subspan(1);
+        }
+    }
+}
+
+static pmr::vector<space_entry2> chunk_space(uint64_t chunk_address, const chunk& c,
+                                             span<const pair<uint64_t, uint64_t>> free_space,
+                                             pmr::memory_resource* mr) {
+    pmr::vector<space_entry> space(mr);
+
+    for (const auto& f : free_space) {
+        if (space.empty()) {
+            if (f.first > chunk_address)
+                space.emplace_back(chunk_address, f.first - chunk_address, true);
+        } else {
+            const auto& l = space.back();
+
+            if (f.first > l.address + l.length)
+                space.emplace_back(l.address + l.length, f.first - l.address - l.length, true);
+        }
+
+        space.emplace_back(f.first, f.second, false);
+    }
+
+    if (space.empty()) // fully-allocated chunk
+        space.emplace_back(chunk_address, c.length, true);
+    else {
+        const auto& l = space.back();
+
+        // anything after the last free space entry is in use
+        if (l.address + l.length < chunk_address + c.length) {
+            space.emplace_back(l.address + l.length,
+                               chunk_address + c.length - l.address - l.length,
+                               true);
+        }
+    }
+
+    array<const btrfs::stripe*, MAX_STRIPES> stripe_buf;
+    auto stripes = span(stripe_buf.data(), c.num_stripes);
+
+    for (unsigned int i = 0; i < c.num_stripes; i++) {
+        stripes[i] = &c.stripe[i];
+    }
+
+    sort(stripes.begin(), stripes.end(), [](const auto& a, const auto& b) {
+        return a->offset < b->offset;
+    });
+
+    pmr::vector<space_entry2> space2(mr);
+
+    for (const auto& s : stripes) {
+        for (const auto& f : space) {
+            uint64_t phys = f.address - chunk_address + s->offset;
+
+            space2.emplace_back(f.address, phys, f.length, f.alloc);
+        }
+    }
+
+    return space2;
+}
+
+struct block_group_info {
+    uint64_t used;
+    uint64_t flags;
+};
+
+// Reads the BLOCK_GROUP_ITEM of each chunk. With the block group tree these
+// are all together, so we can walk the whole thing; otherwise they're
+// scattered through the extent tree, and we look each one up individually.
+static map<uint64_t, block_group_info> load_block_groups(const image& q, const btrfs::super_block& sb,
+                                                         const chunk_table& chunks) {
+    map<uint64_t, block_group_info> ret;
+
+    auto add = [&ret](const btrfs::key& k, span<const uint8_t> sp) {
+        if (sp.size() < sizeof(btrfs::block_group_item)) {
+            throw formatted_error("BLOCK_GROUP_ITEM truncated ({} bytes, expected {})",
+                                  sp.size(), sizeof(btrfs::block_group_item));
+        }
+
+        auto& bgi = *(btrfs::block_group_item*)sp.data();
+
+        ret[k.objectid] = { bgi.used, bgi.flags };
+    };
+
+    if (sb.compat_ro_flags & btrfs::FEATURE_COMPAT_RO_BLOCK_GROUP_TREE) {
+        auto bg_root = find_root(q, sb, chunks, btrfs::BLOCK_GROUP_TREE_OBJECTID);
+
+        if (!bg_root)
+            throw runtime_error("ROOT_ITEM for block group tree not found");
+
+        walk_tree<btrfs::key_type::BLOCK_GROUP_ITEM>(q, sb, bg_root->bytenr, bg_root->level,
+                                                     bg_root->generation, btrfs::BLOCK_GROUP_TREE_OBJECTID,
+                                                     chunks, [&add](const btrfs::key& k, span<const uint8_t> sp) {
+            add(k, sp);
+
+            return true;
+        });
+
+        return ret;
+    }
+
+    auto extent_root = find_root(q, sb, chunks, btrfs::EXTENT_TREE_OBJECTID);
+
+    if (!extent_root)
+        throw runtime_error("ROOT_ITEM for extent tree not found");
+
+    for (const auto& [address, c] : chunks) {
+        btrfs::key search_key = { address, btrfs::key_type::BLOCK_GROUP_ITEM, (uint64_t)c.length };
+
+        find_item(q, sb, extent_root->bytenr, extent_root->level, extent_root->generation,
+                  btrfs::EXTENT_TREE_OBJECTID, chunks, search_key, [&](span<const uint8_t> sp) {
+            add(search_key, sp);
+        });
+    }
+
+    return ret;
+}
+
+// A block group which is entirely used or entirely free doesn't need its
+// free space merging with the dev extents.
+enum class bg_fill {
+    partial,
+    empty,
+    full
+};
+
+struct bg_space {
+    bg_fill fill = bg_fill::partial;
+    pmr::vector<space_entry2> entries; // only for partial
+};
+
+static bg_fill block_group_fill(uint64_t chunk_address, const chunk& c,
+                                span<const pair<uint64_t, uint64_t>> free_space) {
+    if (free_space.empty())
+        return bg_fill::full;
+
+    if (free_space.size() == 1 && free_space[0].first == chunk_address &&
+        free_space[0].second == c.length) {
+        return bg_fill::empty;
+    }
+
+    return bg_fill::partial;
+}
+
+static bg_space make_bg_space(uint64_t chunk_address, const chunk& c,
+                              span<const pair<uint64_t, uint64_t>> free_space,
+                              pmr::memory_resource* mr) {
+    auto fill = block_group_fill(chunk_address, c, free_space);
+
+    if (fill != bg_fill::partial)
+        return { fill, pmr::vector<space_entry2>(mr) };
+
+    return { fill, chunk_space(chunk_address, c, free_space, mr) };
+}
+
+// The most the kernel keeps back from a block group's free space around the
+// superblock copies, which it doesn't count as used either.
+static uint64_t max_super_bytes(uint64_t chunk_address, const chunk& c) {
+    static const uint64_t STRIPE_LEN = 0x10000;
+    static const uint64_t SUPER_INFO_OFFSET = 0x100000;
+
+    uint64_t ret = 0;
+
+    if (chunk_address < SUPER_INFO_OFFSET)
+        ret += SUPER_INFO_OFFSET - chunk_address;
+
+    for (unsigned int i = 0; i < c.num_stripes; i++) {
+        for (auto addr : btrfs::superblock_addrs) {
+            if (addr >= c.stripe[i].offset && addr < c.stripe[i].offset + c.length)
+                ret += STRIPE_LEN;
+        }
+    }
+
+    return ret;
+}
+
+// Checks that the free space tree agrees with the block group items about
+// how much of each block group is in use.
+static void check_block_groups(const chunk_table& chunks,
+                               const map<uint64_t, block_group_info>& bgs,
+                               const pmr::map<uint64_t, pmr::vector<pair<uint64_t, uint64_t>>>& by_chunk,
+                               const finding_func& report) {
+    for (const auto& [address, c] : chunks) {
+        auto it = bgs.find(address);
+
+        if (it == bgs.end())
+            continue;
+
+        const auto& bg = it->second;
+
+        if (bg.flags != c.type) {
+            report({finding_type::block_group_flags_mismatch, address, c.length, address,
+                    c.type, bg.flags});
+        }
+
+        // remapped block groups' extents have moved elsewhere
+        if (c.type & btrfs::BLOCK_GROUP_REMAPPED)
+            continue;
+
+        uint64_t free_bytes = 0;
+
+        if (by_chunk.contains(address)) {
+            for (const auto& f : by_chunk.at(address)) {
+                free_bytes += f.second;
+            }
+        }
+
+        auto not_free = c.length - min(free_bytes, (uint64_t)c.length);
+
+        if (bg.used > not_free || not_free - bg.used > max_super_bytes(address, c)) {
+            report({finding_type::block_group_used_mismatch, address, c.length, address,
+                    not_free, bg.used});
+        }
+    }
+}
+
+// If shard is set, only the parts of the free space tree covering its block
+// groups are read. If bgs is set, the free space is checked against it.
+static pmr::map<uint64_t, bg_space> read_fst(const image& q,
+                                             const chunk_table& chunks,
+                                             const btrfs::super_block& sb,
+                                             const map<uint64_t, block_group_info>* bgs,
+                                             const chunk_table* shard,
+                                             const finding_func& report,
+                                             pmr::memory_resource* mr) {
+    auto fst_root = find_root(q, sb, chunks, btrfs::FREE_SPACE_TREE_OBJECTID);
+
+    if (!fst_root)
+        throw runtime_error("ROOT_ITEM for free space tree not found");
+
+    pmr::vector<pair<uint64_t, uint64_t>> free_space(mr);
+
+    auto add = [&free_space, &sb](const btrfs::key& k, span<const uint8_t> sp) {
+        add_fst_item(k, sp, sb.sectorsize, free_space);
+
+        return true;
+    };
+
+    if (!shard) {
+        walk_tree<btrfs::key_type::FREE_SPACE_EXTENT,
+                  btrfs::key_type::FREE_SPACE_BITMAP>(q, sb, fst_root->bytenr, fst_root->level,
+                                                      fst_root->generation, btrfs::FREE_SPACE_TREE_OBJECTID,
+                                                      chunks, add);
+    } else {
+        for (const auto& [address, c] : *shard) {
+            btrfs::key min_key = { address, (btrfs::key_type)0, 0 };
+            btrfs::key max_key = { address + c.length - 1, (btrfs::key_type)0xff, 0xffffffffffffffff };
+
+            walk_tree_range<btrfs::key_type::FREE_SPACE_EXTENT,
+                            btrfs::key_type::FREE_SPACE_BITMAP>(q, sb, fst_root->bytenr, fst_root->level,
+                                                                fst_root->generation,
+                                                                btrfs::FREE_SPACE_TREE_OBJECTID, chunks,
+                                                                min_key, max_key, add);
+        }
+    }
+
+    const auto& bg_chunks = shard ? *shard : chunks;
+
+    pmr::map<uint64_t, pmr::vector<pair<uint64_t, uint64_t>>> by_chunk(mr);
+
+    for (const auto& f : free_space) {
+        auto it = chunks.upper_bound(f.first);
+
+        if (it == chunks.begin()) {
+            report({finding_type::free_space_outside_chunk, f.first, f.second, 0});
+            continue;
+        }
+
+        by_chunk[prev(it)->first].push_back(f);
+    }
+
+    if (bgs)
+        check_block_groups(bg_chunks, *bgs, by_chunk, report);
+
+    pmr::map<uint64_t, bg_space> space(mr);
+
+    for (const auto& c : bg_chunks) {
+        auto it = by_chunk.find(c.first);
+
+        if (it != by_chunk.end())
+            space.emplace(c.first, make_bg_space(c.first, c.second, it->second, mr));
+        else
+            space.emplace(c.first, make_bg_space(c.first, c.second, {}, mr));
+    }
+
+    return space;
+}
+
+static void classify_extent(const extent2& f, const finding_func& report, waste_metrics* wm) {
+    if (wm && f.btrfs_alloc == btrfs_alloc::chunk_free)
+        wm->free_bytes += f.length;
+
+    if (f.qcow_alloc && f.btrfs_alloc == btrfs_alloc::chunk_free) {
+        report({finding_type::allocated_but_free, f.offset, f.length, f.address});
+
+        if (wm)
+            wm->add_leaked_range(f.length);
+    } else if (!f.qcow_alloc && f.btrfs_alloc == btrfs_alloc::chunk_used) {
+        report({finding_type::discarded_but_used, f.offset, f.length, f.address});
+
+        if (wm)
+            wm->at_risk_bytes += f.length;
+    }
+}
+
+static void do_merge2(uint64_t chunk_address, pmr::vector<extent2>& dev_extents,
+                      bg_space& bs, const finding_func& report,
+                      waste_metrics* wm, pmr::memory_resource* scratch) {
+    (void)chunk_address;
+
+    // If the block group is all used or all free, there's nothing to merge,
+    // and the dev extents can be looked at as they are.
+
+    if (bs.fill != bg_fill::partial) {
+        auto alloc = bs.fill == bg_fill::full ? btrfs_alloc::chunk_used : btrfs_alloc::chunk_free;
+
+        for (const auto& d : dev_extents) {
+            classify_extent({ d.offset, d.length, d.qcow_alloc,
+                              d.btrfs_alloc == btrfs_alloc::superblock ? btrfs_alloc::superblock : alloc,
+                              d.address }, report, wm);
+        }
+
+        return;
+    }
+
+    auto& space = bs.entries;
+
+#if 0
+    cout << format("chunk {:x}:", chunk_address) << endl;
+
+    for (const auto& m : dev_extents) {
+        cout << format("physical address {:x}, length {:x}, qcow_alloc {}, logical address {:x}\n",
+                       m.offset, m.length, m.qcow_alloc, m.address);
+    }
+
+    for (const auto& f : space) {
+        cout << format("space: physical address {:x}, length {:x}, logical address {:x}, alloc {}",
+                       f.phys_address, f.length, f.log_address, f.alloc) << endl;
+    }
+#endif
+
+    pmr::vector<extent2> merged(scratch);
+
+    size_t i = 0, j = 0;
+    while (i < dev_extents.size() && j < space.size()) {
+        auto& d = dev_extents[i];
+        auto& s = space[j];
+
+        enum btrfs_alloc alloc;
+
+        if (d.btrfs_alloc == btrfs_alloc::superblock)
+            alloc = btrfs_alloc::superblock;
+        else if (s.alloc)
+            alloc = btrfs_alloc::chunk_used;
+        else
+            alloc = btrfs_alloc::chunk_free;
+
+        assert(d.offset == s.phys_address);
+
+        if (d.length == s.length) {
+            merged.emplace_back(d.offset, d.length, d.qcow_alloc, alloc,
+                                d.address);
+            i++;
+            j++;
+        } else if (d.length < s.length) {
+            merged.emplace_back(d.offset, d.length, d.qcow_alloc, alloc,
+                                d.address);
+            s.phys_address += d.length;
+            s.log_address += d.length;
+            s.length -= d.length;
+            i++;
+        } else {
+            merged.emplace_back(d.offset, s.length, d.qcow_alloc, alloc,
+                                d.address);
+            d.offset += s.length;
+            d.address += s.length;
+            d.length -= s.length;
+            j++;
+        }
+    }
+
+#if 0
+    for (const auto& f : merged) {
+        cout << format("merged: physical address {:x}, length {:x}, logical address {:x}, qcow_alloc {}, btrfs_alloc {}",
+                       f.offset, f.length, f.address, f.qcow_alloc,
+                       f.btrfs_alloc) << endl;
+    }
+#endif
+
+    for (const auto& f : merged) {
+        classify_extent(f, report, wm);
+    }
+}
+
+static string block_group_type(const chunk& c) {
+    if ((c.type & btrfs::BLOCK_GROUP_DATA) && (c.type & btrfs::BLOCK_GROUP_METADATA))
+        return "mixed";
+    else if (c.type & btrfs::BLOCK_GROUP_DATA)
+        return "data";
+    else if (c.type & btrfs::BLOCK_GROUP_METADATA)
+        return "metadata";
+    else
+        return "system";
+}
+
+static string block_group_profile(const chunk& c) {
+    auto s = format("{}", btrfs::get_chunk_raid_type(c));
+
+    for (auto& ch : s) {
+        ch = (char)tolower(ch);
+    }
+
+    return s;
+}
+
+using finding_buffer = vector<pair<uint64_t, finding>>;
+
+template<typename T>
+concept job_func = is_invocable_v<T, size_t, finding_buffer&>;
+
+// Runs func for each of num_jobs jobs on a pool of threads, not starting any
+// more once the deadline has passed. Each job tags its findings with the
+// address of the chunk it is looking at, and the findings are passed on to
+// report sorted by this afterwards, so the order doesn't depend on how the
+// jobs got scheduled. Returns the number of threads used.
+static unsigned int run_parallel(size_t num_jobs, unsigned int num_threads,
+                                 chrono::steady_clock::time_point deadline,
+                                 const finding_func& report, job_func auto func) {
+    if (num_threads == 0)
+        num_threads = max(thread::hardware_concurrency(), 1u);
+
+    num_threads = (unsigned int)min((size_t)num_threads, max(num_jobs, (size_t)1));
+
+    vector<finding_buffer> results(num_threads);
+    vector<exception_ptr> errors(num_threads);
+    atomic<size_t> next_job = 0;
+
+    {
+        vector<jthread> threads;
+
+        for (unsigned int t = 0; t < num_threads; t++) {
+            threads.emplace_back([num_jobs, deadline, &func, &results, &errors, &next_job, t]() {
+                try {
+                    size_t i;
+
+                    while (chrono::steady_clock::now() < deadline &&
+                           (i = next_job++) < num_jobs) {
+                        func(i, results[t]);
+                    }
+                } catch (...) {
+                    errors[t] = current_exception();
+                }
+            });
+        }
+    }
+
+    for (const auto& e : errors) {
+        if (e)
+            rethrow_exception(e);
+    }
+
+    finding_buffer merged;
+
+    for (auto& r : results) {
+        merged.insert(merged.end(), r.begin(), r.end());
+    }
+
+    stable_sort(merged.begin(), merged.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    for (const auto& m : merged) {
+        report(m.second);
+    }
+
+    return num_threads;
+}
+
+// Passes allocations on to another memory resource, counting them.
+class counting_resource : public pmr::memory_resource {
+public:
+    counting_resource(pmr::memory_resource* upstream, atomic<uint64_t>& count) :
+                      upstream(upstream), count(count) { }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        count.fetch_add(1, memory_order_relaxed);
+
+        return upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        upstream->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    pmr::memory_resource* upstream;
+    atomic<uint64_t>& count;
+};
+
+// Memory for the containers which only last as long as one check, which is
+// all freed together at the end rather than bit by bit. Not thread-safe, so
+// only for the parts which aren't done in parallel.
+struct check_arena {
+    atomic<uint64_t> allocations = 0;
+    atomic<uint64_t> heap_allocations = 0;
+    counting_resource heap{pmr::new_delete_resource(), heap_allocations};
+    pmr::monotonic_buffer_resource arena{0x100000, &heap};
+    counting_resource mr{&arena, allocations};
+
+    void add_stats(stats* st) const {
+        if (st) {
+            st->allocations = allocations;
+            st->heap_allocations = heap_allocations;
+        }
+    }
+};
+
+// Scratch space for a single block group, which starts off on the stack and
+// is thrown away as soon as we've finished with the block group.
+class scratch_arena {
+public:
+    scratch_arena(check_arena& ca) : arena(buf.data(), buf.size(), &ca.heap),
+                                     mr(&arena, ca.allocations) { }
+
+    pmr::memory_resource* get() {
+        return &mr;
+    }
+
+private:
+    array<byte, 0x4000> buf;
+    pmr::monotonic_buffer_resource arena;
+    counting_resource mr;
+};
+
+static bool is_zero_sw(span<const uint8_t> sp) {
+    uint64_t acc = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= sp.size(); i += sizeof(uint64_t)) {
+        uint64_t v;
+
+        memcpy(&v, sp.data() + i, sizeof(v));
+        acc |= v;
+    }
+
+    for (; i < sp.size(); i++) {
+        acc |= sp[i];
+    }
+
+    return acc == 0;
+}
+
+#ifdef __x86_64__
+// We're only given a block at a time, so OR the whole thing together and
+// test it once at the end, rather than branching on every vector.
+__attribute__((target("avx2")))
+static bool is_zero_avx2(span<const uint8_t> sp) {
+    auto p = sp.data();
+    auto len = sp.size();
+    auto acc = _mm256_setzero_si256();
+
+    for (; len >= 4 * sizeof(__m256i); p += 4 * sizeof(__m256i), len -= 4 * sizeof(__m256i)) {
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)p));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)p + 1));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)p + 2));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)p + 3));
+    }
+
+    if (!_mm256_testz_si256(acc, acc))
+        return false;
+
+    return is_zero_sw(span(p, len));
+}
+
+__attribute__((target("avx512f")))
+static bool is_zero_avx512(span<const uint8_t> sp) {
+    auto p = sp.data();
+    auto len = sp.size();
+    auto acc = _mm512_setzero_si512();
+
+    for (; len >= 4 * sizeof(__m512i); p += 4 * sizeof(__m512i), len -= 4 * sizeof(__m512i)) {
+        acc = _mm512_or_si512(acc, _mm512_loadu_si512(p));
+        acc = _mm512_or_si512(acc, _mm512_loadu_si512(p + sizeof(__m512i)));
+        acc = _mm512_or_si512(acc, _mm512_loadu_si512(p + (2 * sizeof(__m512i))));
+        acc = _mm512_or_si512(acc, _mm512_loadu_si512(p + (3 * sizeof(__m512i))));
+    }
+
+    if (_mm512_test_epi64_mask(acc, acc) != 0)
+        return false;
+
+    return is_zero_sw(span(p, len));
+}
+
+static const bool have_avx2 = __builtin_cpu_supports("avx2");
+static const bool have_avx512 = __builtin_cpu_supports("avx512f");
+#endif
+
+static bool is_zero(span<const uint8_t> sp) {
+#ifdef __x86_64__
+    if (have_avx512)
+        return is_zero_avx512(sp);
+    else if (have_avx2)
+        return is_zero_avx2(sp);
+#endif
+
+    return is_zero_sw(sp);
+}
+
+static const uint64_t ZERO_SCAN_BLOCK = 0x1000;
+static const uint64_t ZERO_SCAN_CHUNK = 0x100000; // 1 MiB
+static const uint64_t ZERO_SCAN_READAHEAD = 0x1000000; // 16 MiB
+
+// Reads an allocated but free range, and splits it into the parts which are
+// all zeroes and the parts which aren't. Big ranges are read a chunk at a
+// time, asking for the data a little way ahead to be read in while we scan.
+static void scan_zeroes(const image& q, const finding& f, const finding_func& report) {
+    vector<uint8_t> buf(min(f.length, ZERO_SCAN_CHUNK));
+    optional<finding> pending;
+    auto end = f.offset + f.length;
+
+    auto add = [&](uint64_t offset, uint64_t length, bool zero) {
+        auto type = zero ? finding_type::allocated_but_zeroed : finding_type::allocated_but_free;
+
+        if (pending && pending->type == type) {
+            pending->length += length;
+            return;
+        }
+
+        if (pending)
+            report(*pending);
+
+        pending = finding{type, offset, length, f.address + offset - f.offset};
+    };
+
+    if (f.length > ZERO_SCAN_CHUNK)
+        q.will_need(f.offset, min(f.length, ZERO_SCAN_READAHEAD));
+
+    for (auto pos = f.offset; pos < end; pos += buf.size()) {
+        auto sp = span(buf.data(), min((uint64_t)buf.size(), end - pos));
+
+        if (f.length > ZERO_SCAN_CHUNK && pos + ZERO_SCAN_READAHEAD < end) {
+            q.will_need(pos + ZERO_SCAN_READAHEAD,
+                        min(ZERO_SCAN_CHUNK, end - pos - ZERO_SCAN_READAHEAD));
+        }
+
+        q.read(pos, sp);
+
+        for (uint64_t i = 0; i < sp.size(); i += ZERO_SCAN_BLOCK) {
+            auto block = sp.subspan(i, min(ZERO_SCAN_BLOCK, sp.size() - i));
+
+            add(pos + i, block.size(), is_zero(block));
+        }
+    }
+
+    if (pending)
+        report(*pending);
+}
+
+struct merge_job {
+    uint64_t chunk_address;
+    pmr::vector<extent2>& dev_extents;
+    bg_space& space;
+};
+
+// If zero_scan is set, the allocated but free ranges are read from it and
+// split up by whether they're all zeroes.
+static void do_merge(const chunk_table& chunks,
+                     pmr::map<uint64_t, pmr::vector<extent2>>& dev_extents,
+                     pmr::map<uint64_t, bg_space>& space,
+                     unsigned int num_threads, const image* zero_scan,
+                     const finding_func& report, stats* st, metrics* m, check_arena& ca) {
+    vector<merge_job> jobs;
+
+    for (auto& d : dev_extents) {
+        if (d.first == 0)
+            continue;
+
+        jobs.emplace_back(d.first, d.second, space.at(d.first));
+    }
+
+    vector<waste_metrics> job_metrics(m ? jobs.size() : 0);
+
+    num_threads = run_parallel(jobs.size(), num_threads, chrono::steady_clock::time_point::max(),
+                               report, [&jobs, &job_metrics, m, &ca, zero_scan](size_t i, finding_buffer& buf) {
+        auto& j = jobs[i];
+        scratch_arena scratch(ca);
+
+        auto add = [&buf, &j](const finding& f) {
+            buf.emplace_back(j.chunk_address, f);
+        };
+
+        do_merge2(j.chunk_address, j.dev_extents, j.space, [zero_scan, &add](const finding& f) {
+            if (zero_scan && f.type == finding_type::allocated_but_free)
+                scan_zeroes(*zero_scan, f, add);
+            else
+                add(f);
+        }, m ? &job_metrics[i] : nullptr, scratch.get());
+    });
+
+    if (m) {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const auto& c = chunks.at(jobs[i].chunk_address);
+
+            m->block_groups[make_pair(block_group_type(c), block_group_profile(c))] += job_metrics[i];
+        }
+    }
+
+    if (st) {
+        st->block_groups = jobs.size();
+        st->threads = num_threads;
+        st->trivial_block_groups = count_if(jobs.begin(), jobs.end(), [](const merge_job& j) {
+            return j.space.fill != bg_fill::partial;
+        });
+    }
+}
+
+static pmr::vector<extent2> chunk_dev_extents(const image& q, uint64_t chunk_address,
+                                              const chunk& c, pmr::memory_resource* mr) {
+    pmr::vector<btrfs_extent> extents(mr);
+    pmr::vector<qcow_extent> qcow_extents(mr);
+    array<const btrfs::stripe*, MAX_STRIPES> stripe_buf;
+    auto stripes = span(stripe_buf.data(), c.num_stripes);
+
+    for (unsigned int i = 0; i < c.num_stripes; i++) {
+        stripes[i] = &c.stripe[i];
+    }
+
+    sort(stripes.begin(), stripes.end(), [](const auto& a, const auto& b) {
+        return a->offset < b->offset;
+    });
+
+    for (const auto& s : stripes) {
+        extents.emplace_back(s->offset, c.length, btrfs_alloc::chunk, chunk_address);
+        add_qcow_extents(qcow_extents, q.alloc_map(s->offset, c.length));
+    }
+
+    carve_out_superblocks(extents);
+
+    return merge_extents(extents, qcow_extents);
+}
+
+// A block group belongs to the shard in which its first stripe starts, so that
+// however the image gets split up, each one is checked exactly once.
+static chunk_table shard_chunks(const chunk_table& chunks, uint64_t start, uint64_t end) {
+    map<uint64_t, chunk> ret;
+
+    for (const auto& [address, c] : chunks) {
+        uint64_t first = c.stripe[0].offset;
+
+        for (unsigned int i = 1; i < c.num_stripes; i++) {
+            first = min(first, (uint64_t)c.stripe[i].offset);
+        }
+
+        if (first >= start && first < end)
+            ret.emplace(address, c);
+    }
+
+    return chunk_table(ret);
+}
+
+// Returns the part of the image the options say to look at.
+static pair<uint64_t, uint64_t> physical_range(const options& opts, uint64_t size) {
+    if (opts.range_length == 0)
+        return { 0, size };
+
+    if (opts.range_start >= size)
+        throw formatted_error("range start {:x} is beyond end of image", opts.range_start);
+
+    return { opts.range_start, opts.range_start + min(opts.range_length, size - opts.range_start) };
+}
+
+// Drops the dev extents of block groups belonging to other shards, and redoes
+// any of ours which stick out of the range.
+static void shard_dev_extents(const image& q, const chunk_table& shard, uint64_t start,
+                              uint64_t end, pmr::map<uint64_t, pmr::vector<extent2>>& dev_extents,
+                              pmr::memory_resource* mr) {
+    erase_if(dev_extents, [&shard](const auto& d) {
+        if (d.first == 0)
+            return false;
+
+        auto it = shard.find_containing(d.first);
+
+        return it == shard.end() || it->first != d.first;
+    });
+
+    for (const auto& [address, c] : shard) {
+        bool inside = true;
+
+        for (unsigned int i = 0; i < c.num_stripes; i++) {
+            if (c.stripe[i].offset < start || c.stripe[i].offset + c.length > end)
+                inside = false;
+        }
+
+        if (!inside)
+            dev_extents.insert_or_assign(address, chunk_dev_extents(q, address, c, mr));
+    }
+}
+
+static unsigned int block_group_stratum(const chunk& c, uint64_t used) {
+    unsigned int type;
+
+    if ((c.type & btrfs::BLOCK_GROUP_DATA) && (c.type & btrfs::BLOCK_GROUP_METADATA))
+        type = 3; // mixed
+    else if (c.type & btrfs::BLOCK_GROUP_DATA)
+        type = 0;
+    else if (c.type & btrfs::BLOCK_GROUP_METADATA)
+        type = 1;
+    else
+        type = 2;
+
+    // split into quarters by how full the block group is
+
+    auto fill = (unsigned int)min(used * 4 / c.length, (uint64_t)3);
+
+    return (type * 4) + fill;
+}
+
+struct csum_job {
+    uint64_t address;
+    uint64_t length;
+    vector<uint8_t> csums;
+};
+
+static void read_logical(const image& q, const btrfs::super_block& sb, uint64_t address,
+                         span<uint8_t> buf, const chunk_table& chunks) {
+    auto& [chunk_start, c] = find_chunk(chunks, address);
+
+    if (!(c.type & btrfs::BLOCK_GROUP_REMAPPED)) {
+        q.read(get_physical_address(q, sb, address, chunks), buf);
+        return;
+    }
+
+    // remaps can be as small as a sector, so resolve each one separately
+
+    while (!buf.empty()) {
+        auto to_read = min(buf.size(), (size_t)sb.sectorsize);
+
+        q.read(get_physical_address(q, sb, address, chunks), buf.subspan(0, to_read));
+
+        address += to_read;
+        buf = buf.subspan(to_read);
+    }
+}
+
+static vector<csum_job> load_csum_jobs(const image& q, const btrfs::super_block& sb,
+                                       const chunk_table& chunks) {
+    static const uint64_t MAX_JOB_SECTORS = 1024;
+    static const btrfs::key min_key = { btrfs::EXTENT_CSUM_OBJECTID, btrfs::key_type::EXTENT_CSUM, 0 };
+    static const btrfs::key max_key = { btrfs::EXTENT_CSUM_OBJECTID, btrfs::key_type::EXTENT_CSUM, 0xffffffffffffffff };
+
+    auto csum_root = find_root(q, sb, chunks, btrfs::CSUM_TREE_OBJECTID);
+
+    if (!csum_root)
+        throw runtime_error("ROOT_ITEM for csum tree not found");
+
+    auto csum_size = btrfs::csum_size(sb.csum_type);
+    vector<csum_job> jobs;
+
+    walk_tree_range<btrfs::key_type::EXTENT_CSUM>(q, sb, csum_root->bytenr, csum_root->level,
+                                                  csum_root->generation, btrfs::CSUM_TREE_OBJECTID,
+                                                  chunks, min_key, max_key,
+                                                  [&](const btrfs::key& k, span<const uint8_t> sp) {
+        if (sp.size() % csum_size != 0) {
+            throw formatted_error("EXTENT_CSUM for {:x} was {} bytes, expected multiple of {}",
+                                  k.offset, sp.size(), csum_size);
+        }
+
+        auto address = k.offset;
+
+        // split into jobs, not crossing chunk boundaries
+
+        while (!sp.empty()) {
+            auto& [chunk_start, c] = find_chunk(chunks, address);
+            auto sectors = min((uint64_t)(sp.size() / csum_size), MAX_JOB_SECTORS);
+
+            sectors = min(sectors, (chunk_start + c.length - address) / sb.sectorsize);
+
+            if (sectors == 0)
+                throw formatted_error("EXTENT_CSUM for {:x} crosses end of chunk", k.offset);
+
+            jobs.emplace_back(address, sectors * sb.sectorsize,
+                              vector<uint8_t>(sp.begin(), sp.begin() + (sectors * csum_size)));
+
+            address += sectors * sb.sectorsize;
+            sp = sp.subspan(sectors * csum_size);
+        }
+
+        return true;
+    });
+
+    return jobs;
+}
+
+static void verify_csum_job(const image& q, const btrfs::super_block& sb,
+                            const chunk_table& chunks, const csum_job& j,
+                            const finding_func& report) {
+    auto csum_size = btrfs::csum_size(sb.csum_type);
+    vector<uint8_t> data(j.length), calc(j.csums.size());
+
+    read_logical(q, sb, j.address, data, chunks);
+
+    btrfs::calc_data_csums(sb.csum_type, data, sb.sectorsize, calc);
+
+    // report runs of bad sectors as one finding
+
+    optional<uint64_t> bad_start;
+    auto num_sectors = j.length / sb.sectorsize;
+
+    for (uint64_t i = 0; i <= num_sectors; i++) {
+        bool bad = i < num_sectors &&
+                   memcmp(calc.data() + (i * csum_size), j.csums.data() + (i * csum_size), csum_size);
+
+        if (bad && !bad_start.has_value())
+            bad_start = j.address + (i * sb.sectorsize);
+        else if (!bad && bad_start.has_value()) {
+            report({finding_type::data_csum_mismatch,
+                    get_physical_address(q, sb, *bad_start, chunks),
+                    j.address + (i * sb.sectorsize) - *bad_start, *bad_start});
+            bad_start.reset();
+        }
+    }
+}
+
+static void verify_data(const image& q, const btrfs::super_block& sb,
+                        const chunk_table& chunks, unsigned int num_threads,
+                        const finding_func& report, stats* st) {
+    auto jobs = load_csum_jobs(q, sb, chunks);
+
+    run_parallel(jobs.size(), num_threads, chrono::steady_clock::time_point::max(),
+                 report, [&](size_t i, finding_buffer& buf) {
+        const auto& j = jobs[i];
+
+        verify_csum_job(q, sb, chunks, j, [&buf, &j](const finding& f) {
+            buf.emplace_back(j.address, f);
+        });
+    });
+
+    if (st) {
+        for (const auto& j : jobs) {
+            st->data_csum_bytes += j.length;
+        }
+    }
+}
+
+// Returns the logical ranges covered by the csum tree, with adjacent items
+// joined together.
+static vector<pair<uint64_t, uint64_t>> csum_ranges(const image& q, const btrfs::super_block& sb,
+                                                    const chunk_table& chunks) {
+    static const btrfs::key min_key = { btrfs::EXTENT_CSUM_OBJECTID, btrfs::key_type::EXTENT_CSUM, 0 };
+    static const btrfs::key max_key = { btrfs::EXTENT_CSUM_OBJECTID, btrfs::key_type::EXTENT_CSUM, 0xffffffffffffffff };
+
+    auto csum_root = find_root(q, sb, chunks, btrfs::CSUM_TREE_OBJECTID);
+
+    if (!csum_root)
+        throw runtime_error("ROOT_ITEM for csum tree not found");
+
+    auto csum_size = btrfs::csum_size(sb.csum_type);
+    vector<pair<uint64_t, uint64_t>> ranges;
+
+    walk_tree_range<btrfs::key_type::EXTENT_CSUM>(q, sb, csum_root->bytenr, csum_root->level,
+                                                  csum_root->generation, btrfs::CSUM_TREE_OBJECTID,
+                                                  chunks, min_key, max_key,
+                                                  [&](const btrfs::key& k, span<const uint8_t> sp) {
+        auto length = (sp.size() / csum_size) * sb.sectorsize;
+
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == k.offset)
+            ranges.back().second += length;
+        else
+            ranges.emplace_back(k.offset, length);
+
+        return true;
+    });
+
+    return ranges;
+}
+
+struct phys_range {
+    uint64_t phys_address;
+    uint64_t log_address;
+    uint64_t length;
+};
+
+// Adds the physical ranges for a logical range, one for each stripe.
+static void add_phys_ranges(const image& q, const btrfs::super_block& sb,
+                            const chunk_table& chunks, uint64_t address,
+                            uint64_t length, vector<phys_range>& phys) {
+    while (length > 0) {
+        auto& [chunk_start, c] = find_chunk(chunks, address);
+        auto to_do = min(length, chunk_start + c.length - address);
+
+        if (c.type & btrfs::BLOCK_GROUP_REMAPPED) {
+            // remaps can be as small as a sector, so resolve each one separately
+
+            to_do = min(to_do, (uint64_t)sb.sectorsize);
+
+            phys.emplace_back(get_physical_address(q, sb, address, chunks), address, to_do);
+        } else {
+            for (unsigned int i = 0; i < c.num_stripes; i++) {
+                phys.emplace_back(address - chunk_start + c.stripe[i].offset, address, to_do);
+            }
+        }
+
+        address += to_do;
+        length -= to_do;
+    }
+}
+
+// Sorts phys, and merge-joins it against the runs of the qcow map, reporting
+// anything that has been discarded.
+static void report_discarded(const image& q, vector<phys_range>& phys, finding_type type,
+                             const finding_func& report) {
+    sort(phys.begin(), phys.end(), [](const auto& a, const auto& b) {
+        return a.phys_address < b.phys_address;
+    });
+
+    auto qm = q.alloc_map(0, q.size());
+    optional<finding> pending;
+    size_t j = 0;
+
+    for (const auto& p : phys) {
+        while (j < qm.size() && qm[j].start + qm[j].length <= p.phys_address) {
+            j++;
+        }
+
+        for (auto k = j; k < qm.size() && qm[k].start < p.phys_address + p.length; k++) {
+            if (!qm[k].zero)
+                continue;
+
+            auto start = max(qm[k].start, p.phys_address);
+            auto end = min(qm[k].start + qm[k].length, p.phys_address + p.length);
+            auto log_address = p.log_address + start - p.phys_address;
+
+            if (pending && pending->offset + pending->length == start &&
+                pending->address + pending->length == log_address) {
+                pending->length += end - start;
+                continue;
+            }
+
+            if (pending)
+                report(*pending);
+
+            pending = finding{type, start, end - start, log_address};
+        }
+    }
+
+    if (pending)
+        report(*pending);
+}
+
+static void check_csum_coverage(const image& q, const btrfs::super_block& sb,
+                                const chunk_table& chunks,
+                                const finding_func& report) {
+    vector<phys_range> phys;
+
+    for (auto [address, length] : csum_ranges(q, sb, chunks)) {
+        add_phys_ranges(q, sb, chunks, address, length, phys);
+    }
+
+    report_discarded(q, phys, finding_type::discarded_but_checksummed, report);
+}
+
+struct tree_job {
+    uint64_t objectid;
+    root_info root;
+};
+
+static void collect_tree_blocks(const image& q, const btrfs::super_block& sb,
+                                const chunk_table& chunks, uint64_t address,
+                                uint8_t level, uint64_t generation, unordered_set<uint64_t>& seen,
+                                mutex& seen_mutex, vector<uint64_t>& blocks) {
+    {
+        lock_guard lg(seen_mutex);
+
+        // shared with a snapshot we've already looked at
+        if (!seen.insert(address).second)
+            return;
+    }
+
+    blocks.push_back(address);
+
+    // no need to read leaves, as we only want their addresses
+    if (level == 0)
+        return;
+
+    auto tb = read_tree_block(q, sb, address, level, generation, ANY_OWNER, chunks);
+    auto& h = tb.header();
+
+    span items((const btrfs::key_ptr*)(tb.data.data() + sizeof(btrfs::header)), h.nritems);
+
+    for (const auto& it : items) {
+        collect_tree_blocks(q, sb, chunks, it.blockptr, level - 1, it.generation,
+                            seen, seen_mutex, blocks);
+    }
+}
+
+static void check_tree_blocks(const image& q, const btrfs::super_block& sb,
+                              const chunk_table& chunks, unsigned int num_threads,
+                              const finding_func& report, stats* st) {
+    vector<tree_job> jobs;
+
+    jobs.emplace_back(btrfs::ROOT_TREE_OBJECTID, root_info{sb.root, sb.root_level, sb.generation});
+    jobs.emplace_back(btrfs::CHUNK_TREE_OBJECTID, root_info{sb.chunk_root, sb.chunk_root_level,
+                                                            sb.chunk_root_generation});
+
+    if (sb.incompat_flags & btrfs::FEATURE_INCOMPAT_REMAP_TREE) {
+        jobs.emplace_back(btrfs::REMAP_TREE_OBJECTID, root_info{sb.remap_root, sb.remap_root_level,
+                                                                sb.remap_root_generation});
+    }
+
+    walk_tree<btrfs::key_type::ROOT_ITEM>(q, sb, sb.root, sb.root_level, sb.generation,
+                                          btrfs::ROOT_TREE_OBJECTID, chunks,
+                                          [&jobs](const btrfs::key& k, span<const uint8_t> sp) {
+        if (sp.size() < sizeof(btrfs::root_item)) {
+            throw formatted_error("ROOT_ITEM truncated ({} bytes, expected {})",
+                                  sp.size(), sizeof(btrfs::root_item));
+        }
+
+        auto& ri = *(btrfs::root_item*)sp.data();
+
+        // skip subvolumes in the process of being deleted
+        if (ri.refs == 0)
+            return true;
+
+        jobs.emplace_back(k.objectid, root_info{(uint64_t)ri.bytenr, ri.level, (uint64_t)ri.generation});
+
+        return true;
+    });
+
+    unordered_set<uint64_t> seen;
+    mutex seen_mutex;
+    vector<vector<uint64_t>> job_blocks(jobs.size());
+
+    run_parallel(jobs.size(), num_threads, chrono::steady_clock::time_point::max(),
+                 report, [&](size_t i, finding_buffer&) {
+        const auto& j = jobs[i];
+
+        collect_tree_blocks(q, sb, chunks, j.root.bytenr, j.root.level, j.root.generation,
+                            seen, seen_mutex, job_blocks[i]);
+    });
+
+    vector<phys_range> phys;
+
+    for (const auto& blocks : job_blocks) {
+        for (auto address : blocks) {
+            add_phys_ranges(q, sb, chunks, address, sb.nodesize, phys);
+        }
+    }
+
+    report_discarded(q, phys, finding_type::tree_block_discarded, report);
+
+    if (st)
+        st->tree_blocks_checked = seen.size();
+}
+
+// Sorts a list of [start, end) ranges, and joins up any which overlap or touch.
+static void join_ranges(vector<pair<uint64_t, uint64_t>>& ranges) {
+    sort(ranges.begin(), ranges.end());
+
+    size_t j = 0;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (j != 0 && ranges[i].first <= ranges[j - 1].second)
+            ranges[j - 1].second = max(ranges[j - 1].second, ranges[i].second);
+        else
+            ranges[j++] = ranges[i];
+    }
+
+    ranges.resize(j);
+}
+
+// Reads a tree block we know nothing about beyond its address, as the parent
+// of a shared backref.
+static vector<uint8_t> read_parent_node(const image& q, const btrfs::super_block& sb, uint64_t address,
+                                        const chunk_table& chunks) {
+    vector<uint8_t> v;
+
+    v.resize(sb.nodesize);
+
+    q.read(get_physical_address(q, sb, address, chunks), v);
+
+    auto& h = *(btrfs::header*)v.data();
+
+    if (!btrfs::check_tree_csum(h, sb))
+        throw formatted_error("csum error while reading tree block at {:x}", address);
+
+    if (h.bytenr != address) {
+        throw formatted_error("tree address header mismatch ({:x}, expected {:x})",
+                              (uint64_t)h.bytenr, address);
+    }
+
+    return v;
+}
+
+// The subvolume trees, which are what the backrefs of data extents point to.
+// Those with no refs left are being deleted, and the parts which have already
+// been dropped may have been reused, so we don't read them - anything they
+// still refer to counts as wholly referenced.
+struct subvol_roots {
+    map<uint64_t, root_info> live;
+    set<uint64_t> dying;
+};
+
+static subvol_roots find_subvol_roots(const image& q, const btrfs::super_block& sb,
+                                      const chunk_table& chunks) {
+    subvol_roots ret;
+
+    walk_tree<btrfs::key_type::ROOT_ITEM>(q, sb, sb.root, sb.root_level, sb.generation,
+                                          btrfs::ROOT_TREE_OBJECTID, chunks,
+                                          [&ret](const btrfs::key& k, span<const uint8_t> sp) {
+        if (k.objectid != btrfs::FS_TREE_OBJECTID && k.objectid != btrfs::DATA_RELOC_TREE_OBJECTID &&
+            (k.objectid < btrfs::FIRST_FREE_OBJECTID || k.objectid > btrfs::LAST_FREE_OBJECTID)) {
+            return true;
+        }
+
+        if (sp.size() < sizeof(btrfs::root_item)) {
+            throw formatted_error("ROOT_ITEM truncated ({} bytes, expected {})",
+                                  sp.size(), sizeof(btrfs::root_item));
+        }
+
+        auto& ri = *(btrfs::root_item*)sp.data();
+
+        if (ri.refs == 0)
+            ret.dying.insert(k.objectid);
+        else
+            ret.live.emplace(k.objectid, root_info{(uint64_t)ri.bytenr, ri.level, (uint64_t)ri.generation});
+
+        return true;
+    });
+
+    return ret;
+}
+
+// A data extent, and its backrefs.
+struct data_extent {
+    uint64_t address;
+    uint64_t length;
+    vector<btrfs::extent_data_ref> refs;
+    vector<uint64_t> parents; // of shared backrefs
+};
+
+// Adds the part of the extent e which a file extent item refers to, if it
+// refers to e at all.
+static void add_file_extent_ref(const data_extent& e, span<const uint8_t> sp,
+                                vector<pair<uint64_t, uint64_t>>& referenced) {
+    if (sp.size() < sizeof(btrfs::file_extent_item))
+        return;
+
+    const auto& fei = *(btrfs::file_extent_item*)sp.data();
+
+    if (fei.type == btrfs::file_extent_type::INLINE || fei.disk_bytenr != e.address)
+        return;
+
+    // offset and num_bytes are of the uncompressed data, so any reference at
+    // all to a compressed extent keeps the whole thing
+
+    if (fei.compression != 0)
+        referenced.emplace_back(e.address, e.address + e.length);
+    else {
+        referenced.emplace_back(fei.disk_bytenr + fei.offset,
+                                fei.disk_bytenr + fei.offset + fei.num_bytes);
+    }
+}
+
+// Follows the backrefs of a data extent to the file extent items which refer
+// to it, and returns the parts of it they cover, sorted and joined up.
+static vector<pair<uint64_t, uint64_t>> referenced_ranges(const image& q, const btrfs::super_block& sb,
+                                                          const chunk_table& chunks,
+                                                          const subvol_roots& roots,
+                                                          const data_extent& e) {
+    static const uint64_t MAX_UNCOMPRESSED = 0x20000;
+
+    vector<pair<uint64_t, uint64_t>> ret;
+    auto whole = [&]() {
+        return vector<pair<uint64_t, uint64_t>>{ { e.address, e.address + e.length } };
+    };
+
+    for (const auto& r : e.refs) {
+        if (roots.dying.contains(r.root))
+            return whole();
+
+        auto it = roots.live.find(r.root);
+
+        if (it == roots.live.end())
+            return whole();
+
+        // The backref's offset is that of the file extent item less the
+        // offset into the extent, which is less than the extent's length, or
+        // for compressed extents its uncompressed length. It can wrap round
+        // for reflinked extents.
+
+        auto start = (uint64_t)r.offset;
+        auto end = start + max(e.length, MAX_UNCOMPRESSED);
+
+        if (end < start)
+            start = 0;
+
+        btrfs::tree_cursor c(tree_reader(q, sb, ANY_OWNER, chunks), it->second.bytenr,
+                             it->second.level, it->second.generation);
+        uint32_t found = 0;
+
+        c.search({ r.objectid, btrfs::key_type::EXTENT_DATA, start });
+
+        while (found < r.count && c.valid()) {
+            const auto& k = c.item_key();
+
+            if (k.objectid != r.objectid || k.type != btrfs::key_type::EXTENT_DATA || k.offset >= end)
+                break;
+
+            auto n = ret.size();
+
+            add_file_extent_ref(e, c.item_data(), ret);
+
+            if (ret.size() != n)
+                found++;
+
+            c.next();
+        }
+    }
+
+    for (auto parent : e.parents) {
+        auto v = read_parent_node(q, sb, parent, chunks);
+        const auto& h = *(btrfs::header*)v.data();
+
+        if (h.level != 0)
+            return whole();
+
+        span items((btrfs::item*)(v.data() + sizeof(btrfs::header)), h.nritems);
+
+        for (const auto& it : items) {
+            if (it.key.type != btrfs::key_type::EXTENT_DATA)
+                continue;
+
+            add_file_extent_ref(e, span(v.data() + sizeof(btrfs::header) + it.offset, it.size), ret);
+        }
+    }
+
+    join_ranges(ret);
+
+    return ret;
+}
+
+// Works out which parts of the data extents in a block group nothing refers
+// to, and how much of them is allocated in the image. Only one extent's
+// backrefs are held at a time.
+static bookend_usage block_group_bookends(const image& q, const btrfs::super_block& sb,
+                                          const chunk_table& chunks, const root_info& extent_root,
+                                          const subvol_roots& roots, uint64_t chunk_address,
+                                          const chunk& c, size_t& backrefs) {
+    bookend_usage ret{chunk_address, 0, 0};
+    optional<data_extent> e;
+
+    btrfs::key min_key = { chunk_address, (btrfs::key_type)0, 0 };
+    btrfs::key max_key = { chunk_address + c.length - 1, (btrfs::key_type)0xff, 0xffffffffffffffff };
+
+    auto add_unreferenced = [&](uint64_t start, uint64_t end) {
+        ret.unreferenced_bytes += end - start;
+
+        for (unsigned int i = 0; i < c.num_stripes; i++) {
+            auto phys = c.stripe[i].offset + start - chunk_address;
+
+            for (const auto& m : q.alloc_map(phys, end - start)) {
+                if (!m.zero)
+                    ret.allocated_bytes += m.length;
+            }
+        }
+    };
+
+    auto finish_extent = [&]() {
+        if (!e)
+            return;
+
+        backrefs += e->refs.size() + e->parents.size();
+
+        auto pos = e->address;
+        auto end = e->address + e->length;
+
+        for (const auto& r : referenced_ranges(q, sb, chunks, roots, *e)) {
+            if (r.first > pos)
+                add_unreferenced(pos, min(r.first, end));
+
+            pos = max(pos, r.second);
+        }
+
+        if (pos < end)
+            add_unreferenced(pos, end);
+
+        e.reset();
+    };
+
+    walk_tree_range<btrfs::key_type::EXTENT_ITEM,
+                    btrfs::key_type::EXTENT_DATA_REF,
+                    btrfs::key_type::SHARED_DATA_REF>(q, sb, extent_root.bytenr, extent_root.level,
+                                                      extent_root.generation, btrfs::EXTENT_TREE_OBJECTID,
+                                                      chunks, min_key, max_key,
+                                                      [&](const btrfs::key& k, span<const uint8_t> sp) {
+        if (k.type == btrfs::key_type::EXTENT_ITEM) {
+            finish_extent();
+
+            if (sp.size() < sizeof(btrfs::extent_item)) {
+                throw formatted_error("EXTENT_ITEM truncated ({} bytes, expected {})",
+                                      sp.size(), sizeof(btrfs::extent_item));
+            }
+
+            auto& ei = *(btrfs::extent_item*)sp.data();
+
+            if (!(ei.flags & btrfs::EXTENT_FLAG_DATA))
+                return true;
+
+            e.emplace(k.objectid, k.offset);
+
+            // inline backrefs
+
+            sp = sp.subspan(sizeof(btrfs::extent_item));
+
+            while (sp.size() >= 1 + sizeof(uint64_t)) {
+                auto type = (btrfs::key_type)sp[0];
+
+                sp = sp.subspan(1);
+
+                switch (type) {
+                    case btrfs::key_type::EXTENT_DATA_REF:
+                        if (sp.size() < sizeof(btrfs::extent_data_ref))
+                            return true;
+
+                        e->refs.push_back(*(btrfs::extent_data_ref*)sp.data());
+                        sp = sp.subspan(sizeof(btrfs::extent_data_ref));
+                        break;
+
+                    case btrfs::key_type::SHARED_DATA_REF:
+                        if (sp.size() < sizeof(uint64_t) + sizeof(btrfs::shared_data_ref))
+                            return true;
+
+                        e->parents.push_back(*(uint64_t*)sp.data());
+                        sp = sp.subspan(sizeof(uint64_t) + sizeof(btrfs::shared_data_ref));
+                        break;
+
+                    case btrfs::key_type::EXTENT_OWNER_REF:
+                        sp = sp.subspan(sizeof(uint64_t));
+                        break;
+
+                    default:
+                        return true;
+                }
+            }
+
+            return true;
+        }
+
+        // keyed backrefs, which come straight after their extent
+
+        if (!e || e->address != k.objectid)
+            return true;
+
+        if (k.type == btrfs::key_type::SHARED_DATA_REF)
+            e->parents.push_back(k.offset);
+        else if (sp.size() >= sizeof(btrfs::extent_data_ref))
+            e->refs.push_back(*(btrfs::extent_data_ref*)sp.data());
+
+        return true;
+    });
+
+    finish_extent();
+
+    return ret;
+}
+
+// Streams the ranges described by the items of a tree between two objectids,
+// so that we never hold more than a path's worth of it in memory.
+class range_stream {
+public:
+    using decode_func = function<void(const btrfs::key&, span<const uint8_t>,
+                                      vector<pair<uint64_t, uint64_t>>&)>;
+
+    range_stream(btrfs::tree_cursor cursor, uint64_t start, uint64_t end, decode_func decode) :
+                 cursor(move(cursor)), end(end), decode(move(decode)) {
+        btrfs::key k = { start, (btrfs::key_type)0, 0 };
+
+        this->cursor.search(k);
+    }
+
+    optional<pair<uint64_t, uint64_t>> next() {
+        while (pos == pending.size()) {
+            if (!cursor.valid() || cursor.item_key().objectid >= end)
+                return nullopt;
+
+            pending.clear();
+            pos = 0;
+
+            decode(cursor.item_key(), cursor.item_data(), pending);
+
+            cursor.next();
+        }
+
+        return pending[pos++];
+    }
+
+private:
+    btrfs::tree_cursor cursor;
+    uint64_t end;
+    decode_func decode;
+    vector<pair<uint64_t, uint64_t>> pending;
+    size_t pos = 0;
+};
+
+static void check_bg_extents(const image& q, const btrfs::super_block& sb,
+                             const chunk_table& chunks, const root_info& extent_root,
+                             const root_info& fst_root, uint64_t chunk_address, const chunk& c,
+                             const finding_func& report) {
+    auto end = chunk_address + c.length;
+
+    range_stream used(btrfs::tree_cursor(tree_reader(q, sb, btrfs::EXTENT_TREE_OBJECTID, chunks),
+                                         extent_root.bytenr, extent_root.level,
+                                         extent_root.generation),
+                      chunk_address, end,
+                      [&sb](const btrfs::key& k, span<const uint8_t>, vector<pair<uint64_t, uint64_t>>& v) {
+        if (k.type == btrfs::key_type::EXTENT_ITEM)
+            v.emplace_back(k.objectid, k.offset);
+        else if (k.type == btrfs::key_type::METADATA_ITEM)
+            v.emplace_back(k.objectid, sb.nodesize);
+    });
+
+    range_stream free_space(btrfs::tree_cursor(tree_reader(q, sb, btrfs::FREE_SPACE_TREE_OBJECTID, chunks),
+                                         fst_root.bytenr, fst_root.level, fst_root.generation),
+                      chunk_address, end,
+                      [&sb](const btrfs::key& k, span<const uint8_t> sp, vector<pair<uint64_t, uint64_t>>& v) {
+        add_fst_item(k, sp, sb.sectorsize, v);
+    });
+
+    // The superblock copies are neither free nor in the extent tree, so
+    // don't complain about them.
+
+    vector<pair<uint64_t, uint64_t>> superblocks;
+
+    for (unsigned int i = 0; i < c.num_stripes; i++) {
+        for (auto addr : btrfs::superblock_addrs) {
+            if (addr >= c.stripe[i].offset && addr < c.stripe[i].offset + c.length) {
+                superblocks.emplace_back(chunk_address + addr - c.stripe[i].offset,
+                                         sizeof(btrfs::super_block));
+            }
+        }
+    }
+
+    sort(superblocks.begin(), superblocks.end());
+
+    optional<finding> pending;
+
+    auto add = [&](finding_type type, uint64_t start, uint64_t length) {
+        if (pending && pending->type == type && pending->offset + pending->length == start) {
+            pending->length += length;
+            return;
+        }
+
+        if (pending)
+            report(*pending);
+
+        pending = finding{type, start, length, chunk_address};
+    };
+
+    auto add_neither = [&](uint64_t start, uint64_t seg_end) {
+        for (const auto& sbr : superblocks) {
+            if (sbr.first + sbr.second <= start || sbr.first >= seg_end)
+                continue;
+
+            if (sbr.first > start)
+                add(finding_type::neither_free_nor_used, start, sbr.first - start);
+
+            start = min(seg_end, sbr.first + sbr.second);
+        }
+
+        if (start < seg_end)
+            add(finding_type::neither_free_nor_used, start, seg_end - start);
+    };
+
+    auto u = used.next();
+    auto f = free_space.next();
+    auto pos = chunk_address;
+
+    while (pos < end) {
+        // skip over anything we've already passed
+
+        while (u && u->first + u->second <= pos) {
+            u = used.next();
+        }
+
+        while (f && f->first + f->second <= pos) {
+            f = free_space.next();
+        }
+
+        bool in_u = u && u->first <= pos;
+        bool in_f = f && f->first <= pos;
+        auto seg_end = end;
+
+        if (u)
+            seg_end = min(seg_end, in_u ? u->first + u->second : u->first);
+
+        if (f)
+            seg_end = min(seg_end, in_f ? f->first + f->second : f->first);
+
+        if (in_u && in_f)
+            add(finding_type::free_and_used, pos, seg_end - pos);
+        else if (!in_u && !in_f)
+            add_neither(pos, seg_end);
+
+        pos = seg_end;
+    }
+
+    if (pending)
+        report(*pending);
+}
+
+static void check_extent_tree(const image& q, const btrfs::super_block& sb,
+                              const chunk_table& chunks, const chunk_table& bg_chunks,
+                              unsigned int num_threads, const finding_func& report) {
+    auto extent_root = find_root(q, sb, chunks, btrfs::EXTENT_TREE_OBJECTID);
+
+    if (!extent_root)
+        throw runtime_error("ROOT_ITEM for extent tree not found");
+
+    auto fst_root = find_root(q, sb, chunks, btrfs::FREE_SPACE_TREE_OBJECTID);
+
+    if (!fst_root)
+        throw runtime_error("ROOT_ITEM for free space tree not found");
+
+    vector<pair<uint64_t, const chunk*>> jobs;
+
+    for (const auto& [address, c] : bg_chunks) {
+        // the extents of remapped block groups have moved elsewhere
+        if (c.type & btrfs::BLOCK_GROUP_REMAPPED)
+            continue;
+
+        jobs.emplace_back(address, &c);
+    }
+
+    run_parallel(jobs.size(), num_threads, chrono::steady_clock::time_point::max(),
+                 report, [&](size_t i, finding_buffer& buf) {
+        auto address = jobs[i].first;
+
+        check_bg_extents(q, sb, chunks, *extent_root, *fst_root, address, *jobs[i].second,
+                         [&buf, address](const finding& f) {
+            buf.emplace_back(address, f);
+        });
+    });
+}
+
+checker::checker(const image& img, const options& opts) : img(img), opts(opts) {
+    auto start = chrono::steady_clock::now();
+
+    // FIXME - if first superblock not valid, check others
+
+    img.read(btrfs::superblock_addrs[0], span((uint8_t*)&sb, sizeof(sb)));
+
+    if (sb.magic != btrfs::MAGIC)
+        throw runtime_error("volume was not btrfs");
+
+    if (sb.num_devices != 1)
+        throw runtime_error("multi-device filesystems not supported");
+
+    if (!btrfs::check_superblock_csum(sb))
+        throw runtime_error("superblock csum mismatch");
+
+    if (sb.incompat_flags & ~INCOMPAT_FLAGS)
+        throw formatted_error("unsupported incompat flags {:x}", sb.incompat_flags & ~INCOMPAT_FLAGS);
+
+    chunks = load_chunks(img, sb);
+
+    load_time = chrono::steady_clock::now() - start;
+}
+
+void checker::check(const finding_func& func, stats* st, metrics* m) const {
+    check_arena ca;
+    auto [range_start, range_end] = physical_range(opts, img.size());
+    optional<chunk_table> shard;
+
+    if (opts.range_length != 0)
+        shard = shard_chunks(chunks, range_start, range_end);
+
+    const auto& bg_chunks = shard ? *shard : chunks;
+
+    auto t1 = chrono::steady_clock::now();
+
+    auto dev_extents = check_dev_tree(img, chunks, sb, range_start, range_end, func, &ca.mr);
+
+    if (shard)
+        shard_dev_extents(img, *shard, range_start, range_end, dev_extents, &ca.mr);
+
+    auto t2 = chrono::steady_clock::now();
+
+    if (st) {
+        st->load = load_time;
+        st->dev_tree = t2 - t1;
+    }
+
+    if (opts.free_space) {
+        if (!(sb.compat_ro_flags & btrfs::FEATURE_COMPAT_RO_FREE_SPACE_TREE))
+            func({finding_type::free_space_not_analysed, 0, 0, 0});
+        else {
+            auto t3 = chrono::steady_clock::now();
+
+            // Without the block group tree, this means a search of the extent
+            // tree for every block group, so it's only done if asked for.
+
+            optional<map<uint64_t, block_group_info>> bgs;
+
+            if (opts.block_groups)
+                bgs = load_block_groups(img, sb, chunks);
+
+            auto t4 = chrono::steady_clock::now();
+
+            auto space = read_fst(img, chunks, sb, bgs ? &*bgs : nullptr, shard ? &*shard : nullptr,
+                                  func, &ca.mr);
+
+            auto t5 = chrono::steady_clock::now();
+
+            do_merge(chunks, dev_extents, space, opts.threads, opts.zero_scan ? &img : nullptr,
+                     func, st, m, ca);
+
+            auto t6 = chrono::steady_clock::now();
+
+            if (st) {
+                if (bgs)
+                    st->block_group_items = t4 - t3;
+
+                st->free_space = t5 - t4;
+                st->merge = t6 - t5;
+            }
+        }
+    }
+
+    if (opts.extent_tree) {
+        auto t6 = chrono::steady_clock::now();
+
+        if (!(sb.compat_ro_flags & btrfs::FEATURE_COMPAT_RO_FREE_SPACE_TREE))
+            func({finding_type::free_space_not_analysed, 0, 0, 0});
+        else
+            check_extent_tree(img, sb, chunks, bg_chunks, opts.threads, func);
+
+        if (st)
+            st->extent_tree = chrono::steady_clock::now() - t6;
+    }
+
+    if (opts.tree_blocks) {
+        auto t6 = chrono::steady_clock::now();
+
+        check_tree_blocks(img, sb, chunks, opts.threads, func, st);
+
+        if (st)
+            st->tree_blocks = chrono::steady_clock::now() - t6;
+    }
+
+    if (opts.csum_coverage) {
+        auto t6 = chrono::steady_clock::now();
+
+        check_csum_coverage(img, sb, chunks, func);
+
+        if (st)
+            st->csum_coverage = chrono::steady_clock::now() - t6;
+    }
+
+    if (opts.verify_data) {
+        auto t7 = chrono::steady_clock::now();
+
+        verify_data(img, sb, chunks, opts.threads, func, st);
+
+        if (st)
+            st->data_csum = chrono::steady_clock::now() - t7;
+    }
+
+    ca.add_stats(st);
+}
+
+vector<finding> checker::check(stats* st, metrics* m) const {
+    vector<finding> ret;
+
+    check([&ret](const finding& f) {
+        ret.push_back(f);
+    }, st, m);
+
+    return ret;
+}
+
+struct stratum {
+    size_t size = 0;
+    vector<uint64_t> picks;
+    size_t checked = 0;
+    size_t leaking = 0;
+};
+
+struct sample_job {
+    uint64_t chunk_address;
+    size_t stratum;
+};
+
+sample_result checker::sample(const sample_options& so, const finding_func& func,
+                              stats* st) const {
+    auto start = chrono::steady_clock::now();
+    auto deadline = chrono::steady_clock::time_point::max();
+
+    if (so.time_budget.count() > 0)
+        deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(so.time_budget);
+
+    if (!(sb.compat_ro_flags & btrfs::FEATURE_COMPAT_RO_FREE_SPACE_TREE))
+        throw runtime_error("cannot sample as filesystem is not using free space tree");
+
+    auto fst_root = find_root(img, sb, chunks, btrfs::FREE_SPACE_TREE_OBJECTID);
+
+    if (!fst_root)
+        throw runtime_error("ROOT_ITEM for free space tree not found");
+
+    auto bgs = load_block_groups(img, sb, chunks);
+
+    // sort block groups into strata by type and fill level
+
+    map<unsigned int, stratum> strata_map;
+
+    for (const auto& [address, c] : chunks) {
+        auto it = bgs.find(address);
+
+        if (it == bgs.end())
+            throw formatted_error("BLOCK_GROUP_ITEM for {:x} not found", address);
+
+        auto& s = strata_map[block_group_stratum(c, it->second.used)];
+
+        s.size++;
+        s.picks.push_back(address);
+    }
+
+    vector<stratum> strata;
+
+    for (auto& s : strata_map) {
+        strata.push_back(move(s.second));
+    }
+
+    // take a random selection from each stratum, proportional to its size
+
+    mt19937_64 rng(so.seed != 0 ? so.seed : random_device{}());
+    auto wanted = min(so.block_groups, chunks.size());
+
+    for (auto& s : strata) {
+        auto n = (size_t)llround((double)wanted * (double)s.size / (double)chunks.size());
+
+        n = min(max(n, (size_t)1), s.size);
+
+        shuffle(s.picks.begin(), s.picks.end(), rng);
+        s.picks.resize(n);
+    }
+
+    // Interleave the strata, so that if we run out of time we've still
+    // looked at a bit of everything.
+
+    vector<sample_job> jobs;
+
+    for (size_t r = 0; ; r++) {
+        bool added = false;
+
+        for (size_t i = 0; i < strata.size(); i++) {
+            if (r < strata[i].picks.size()) {
+                jobs.emplace_back(strata[i].picks[r], i);
+                added = true;
+            }
+        }
+
+        if (!added)
+            break;
+    }
+
+    vector<uint8_t> checked(jobs.size()), leaking(jobs.size());
+    check_arena ca;
+
+    auto num_threads = run_parallel(jobs.size(), opts.threads, deadline, func,
+                                    [&](size_t i, finding_buffer& buf) {
+        const auto& j = jobs[i];
+        const auto& c = chunks.at(j.chunk_address);
+        scratch_arena scratch(ca);
+
+        auto dev_extents = chunk_dev_extents(img, j.chunk_address, c, scratch.get());
+
+        // only read the bits of the FST which cover this block group
+
+        pmr::vector<pair<uint64_t, uint64_t>> free_space(scratch.get());
+        btrfs::key min_key = { j.chunk_address, (btrfs::key_type)0, 0 };
+        btrfs::key max_key = { j.chunk_address + c.length - 1, (btrfs::key_type)0xff, 0xffffffffffffffff };
+
+        walk_tree_range<btrfs::key_type::FREE_SPACE_EXTENT,
+                        btrfs::key_type::FREE_SPACE_BITMAP>(img, sb, fst_root->bytenr, fst_root->level,
+                                                            fst_root->generation,
+                                                            btrfs::FREE_SPACE_TREE_OBJECTID, chunks,
+                                                            min_key, max_key,
+                        [&free_space, this](const btrfs::key& k, span<const uint8_t> sp) {
+            add_fst_item(k, sp, sb.sectorsize, free_space);
+
+            return true;
+        });
+
+        auto space = make_bg_space(j.chunk_address, c, free_space, scratch.get());
+
+        do_merge2(j.chunk_address, dev_extents, space, [&buf, &j, &leaking, i](const finding& f) {
+            buf.emplace_back(j.chunk_address, f);
+            leaking[i] = 1;
+        }, nullptr, scratch.get());
+
+        checked[i] = 1;
+    });
+
+    sample_result ret;
+
+    ret.block_groups = chunks.size();
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!checked[i])
+            continue;
+
+        ret.sampled++;
+        strata[jobs[i].stratum].checked++;
+
+        if (leaking[i])
+            strata[jobs[i].stratum].leaking++;
+    }
+
+    // Stratified estimate of the proportion of block groups with errors. The
+    // variance uses the Agresti-Coull adjustment so that strata with no errors
+    // still contribute some uncertainty, and strata we didn't get round to
+    // widen the upper bound as if all their block groups were bad.
+
+    static const double z = 1.96; // 95% confidence
+
+    double covered = 0.0, est = 0.0, var = 0.0;
+
+    for (const auto& s : strata) {
+        if (s.checked == 0)
+            continue;
+
+        auto w = (double)s.size / (double)chunks.size();
+        auto p = (double)s.leaking / (double)s.checked;
+        auto p_adj = ((double)s.leaking + 2.0) / ((double)s.checked + 4.0);
+        auto fpc = 1.0 - ((double)s.checked / (double)s.size);
+
+        covered += w;
+        est += w * p;
+        var += w * w * p_adj * (1.0 - p_adj) / ((double)s.checked + 4.0) * fpc;
+    }
+
+    if (covered > 0.0)
+        ret.leak_rate = est / covered;
+
+    ret.leak_rate_lower = max(0.0, est - (z * sqrt(var)));
+    ret.leak_rate_upper = min(1.0, est + (z * sqrt(var)) + (1.0 - covered));
+
+    if (st) {
+        st->load = load_time;
+        st->merge = chrono::steady_clock::now() - start;
+        st->block_groups = ret.sampled;
+        st->threads = num_threads;
+    }
+
+    ca.add_stats(st);
+
+    return ret;
+}
+
+vector<bookend_usage> checker::bookends(stats* st) const {
+    auto start = chrono::steady_clock::now();
+
+    auto extent_root = find_root(img, sb, chunks, btrfs::EXTENT_TREE_OBJECTID);
+
+    if (!extent_root)
+        throw runtime_error("ROOT_ITEM for extent tree not found");
+
+    optional<chunk_table> shard;
+
+    if (opts.range_length != 0) {
+        auto [range_start, range_end] = physical_range(opts, img.size());
+
+        shard = shard_chunks(chunks, range_start, range_end);
+    }
+
+    auto roots = find_subvol_roots(img, sb, chunks);
+
+    vector<pair<uint64_t, const chunk*>> jobs;
+
+    for (const auto& [address, c] : shard ? *shard : chunks) {
+        if (!(c.type & btrfs::BLOCK_GROUP_DATA) || c.type & btrfs::BLOCK_GROUP_REMAPPED)
+            continue;
+
+        jobs.emplace_back(address, &c);
+    }
+
+    vector<bookend_usage> results(jobs.size());
+    vector<size_t> backrefs(jobs.size());
+
+    run_parallel(jobs.size(), opts.threads, chrono::steady_clock::time_point::max(),
+                 [](const finding&) { }, [&](size_t i, finding_buffer&) {
+        results[i] = block_group_bookends(img, sb, chunks, *extent_root, roots, jobs[i].first,
+                                          *jobs[i].second, backrefs[i]);
+    });
+
+    erase_if(results, [](const bookend_usage& b) {
+        return b.unreferenced_bytes == 0;
+    });
+
+    if (st) {
+        st->load = load_time;
+        st->bookends = chrono::steady_clock::now() - start;
+        st->bookend_refs = accumulate(backrefs.begin(), backrefs.end(), (size_t)0);
+    }
+
+    return results;
+}
+
+reverse_map checker::build_reverse_map(stats* st) const {
+    auto start = chrono::steady_clock::now();
+
+    auto extent_root = find_root(img, sb, chunks, btrfs::EXTENT_TREE_OBJECTID);
+
+    if (!extent_root)
+        throw runtime_error("ROOT_ITEM for extent tree not found");
+
+    reverse_map rm(img, sb, chunks);
+
+    // The backrefs of an extent are either inline in its EXTENT_ITEM or
+    // METADATA_ITEM, or in items of their own straight after it, so one pass
+    // through the tree gives us everything in order.
+
+    auto add_ref = [&rm](uint64_t root, uint64_t inode, uint64_t offset, bool shared) {
+        rm.refs.emplace_back(root, inode, offset, shared);
+    };
+
+    walk_tree<btrfs::key_type::EXTENT_ITEM,
+              btrfs::key_type::METADATA_ITEM,
+              btrfs::key_type::TREE_BLOCK_REF,
+              btrfs::key_type::EXTENT_DATA_REF,
+              btrfs::key_type::SHARED_BLOCK_REF,
+              btrfs::key_type::SHARED_DATA_REF>(img, sb, extent_root->bytenr, extent_root->level,
+                                                extent_root->generation, btrfs::EXTENT_TREE_OBJECTID,
+                                                chunks, [&](const btrfs::key& k, span<const uint8_t> sp) {
+        if (k.type == btrfs::key_type::EXTENT_ITEM || k.type == btrfs::key_type::METADATA_ITEM) {
+            // ignore pre-2.6.31 extent items, which didn't have flags
+            if (sp.size() < sizeof(btrfs::extent_item))
+                return true;
+
+            const auto& ei = *(btrfs::extent_item*)sp.data();
+            auto length = k.type == btrfs::key_type::METADATA_ITEM ? sb.nodesize : k.offset;
+
+            rm.extents.emplace_back(k.objectid, (uint32_t)length, (uint32_t)rm.refs.size());
+
+            sp = sp.subspan(sizeof(btrfs::extent_item));
+
+            if (k.type == btrfs::key_type::EXTENT_ITEM && ei.flags & btrfs::EXTENT_FLAG_TREE_BLOCK) {
+                if (sp.size() < sizeof(btrfs::tree_block_info))
+                    return true;
+
+                sp = sp.subspan(sizeof(btrfs::tree_block_info));
+            }
+
+            while (sp.size() >= 1 + sizeof(uint64_t)) {
+                auto type = (btrfs::key_type)sp[0];
+                auto val = *(uint64_t*)(sp.data() + 1);
+
+                sp = sp.subspan(1);
+
+                switch (type) {
+                    case btrfs::key_type::TREE_BLOCK_REF:
+                        add_ref(val, 0, 0, false);
+                        sp = sp.subspan(sizeof(uint64_t));
+                        break;
+
+                    case btrfs::key_type::SHARED_BLOCK_REF:
+                        add_ref(val, 0, 0, true);
+                        sp = sp.subspan(sizeof(uint64_t));
+                        break;
+
+                    case btrfs::key_type::EXTENT_DATA_REF: {
+                        if (sp.size() < sizeof(btrfs::extent_data_ref))
+                            return true;
+
+                        const auto& edr = *(btrfs::extent_data_ref*)sp.data();
+
+                        add_ref(edr.root, edr.objectid, edr.offset, false);
+                        sp = sp.subspan(sizeof(btrfs::extent_data_ref));
+                        break;
+                    }
+
+                    case btrfs::key_type::SHARED_DATA_REF:
+                        if (sp.size() < sizeof(uint64_t) + sizeof(btrfs::shared_data_ref))
+                            return true;
+
+                        add_ref(val, 0, 0, true);
+                        sp = sp.subspan(sizeof(uint64_t) + sizeof(btrfs::shared_data_ref));
+                        break;
+
+                    case btrfs::key_type::EXTENT_OWNER_REF:
+                        sp = sp.subspan(sizeof(uint64_t));
+                        break;
+
+                    default:
+                        return true;
+                }
+            }
+
+            return true;
+        }
+
+        // keyed backrefs
+
+        if (rm.extents.empty() || rm.extents.back().address != k.objectid)
+            return true;
+
+        switch (k.type) {
+            case btrfs::key_type::TREE_BLOCK_REF:
+                add_ref(k.offset, 0, 0, false);
+                break;
+
+            case btrfs::key_type::SHARED_BLOCK_REF:
+            case btrfs::key_type::SHARED_DATA_REF:
+                add_ref(k.offset, 0, 0, true);
+                break;
+
+            case btrfs::key_type::EXTENT_DATA_REF: {
+                if (sp.size() < sizeof(btrfs::extent_data_ref))
+                    break;
+
+                const auto& edr = *(btrfs::extent_data_ref*)sp.data();
+
+                add_ref(edr.root, edr.objectid, edr.offset, false);
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        return true;
+    });
+
+    rm.extents.shrink_to_fit();
+    rm.refs.shrink_to_fit();
+
+    if (st) {
+        st->rmap_build = chrono::steady_clock::now() - start;
+        st->rmap_extents = rm.extents.size();
+        st->rmap_refs = rm.refs.size();
+    }
+
+    return rm;
+}
+
+void reverse_map::add_owners(const extent& e, const ref& r, uint64_t start, uint64_t end,
+                             vector<extent_owner>& ret) const {
+    if (!r.shared) {
+        ret.emplace_back(start, end - start, r.root, r.inode,
+                         r.inode != 0 ? r.offset + start - e.address : 0);
+        return;
+    }
+
+    // For a shared ref we only know the parent, which is the tree block
+    // holding the pointer to the extent. Its owner is the tree, and if it's
+    // a leaf we can look through it for the file.
+
+    auto v = read_parent_node(img, sb, r.root, chunks);
+    const auto& h = *(btrfs::header*)v.data();
+
+    if (h.level != 0) {
+        ret.emplace_back(start, end - start, h.owner, 0, 0);
+        return;
+    }
+
+    span items((btrfs::item*)(v.data() + sizeof(btrfs::header)), h.nritems);
+    bool found = false;
+
+    for (const auto& it : items) {
+        if (it.key.type != btrfs::key_type::EXTENT_DATA || it.size < sizeof(btrfs::file_extent_item))
+            continue;
+
+        const auto& fei = *(btrfs::file_extent_item*)(v.data() + sizeof(btrfs::header) + it.offset);
+
+        if (fei.type == btrfs::file_extent_type::INLINE || fei.disk_bytenr != e.address)
+            continue;
+
+        // several items in the same leaf can point to different bits of one extent
+
+        auto base = it.key.offset - fei.offset;
+
+        found = true;
+
+        if (any_of(ret.begin(), ret.end(), [&](const extent_owner& o) {
+            return o.address == start && o.tree == h.owner && o.inode == it.key.objectid &&
+                   o.offset == base + start - e.address;
+        })) {
+            continue;
+        }
+
+        ret.emplace_back(start, end - start, h.owner, it.key.objectid, base + start - e.address);
+    }
+
+    if (!found)
+        ret.emplace_back(start, end - start, h.owner, 0, 0);
+}
+
+vector<extent_owner> reverse_map::lookup(uint64_t address, uint64_t length, stats* st) const {
+    auto t1 = chrono::steady_clock::now();
+    vector<extent_owner> ret;
+    auto end = address + length;
+
+    // extents don't overlap, so only the one before the first which starts
+    // after address can begin before it
+
+    auto it = upper_bound(extents.begin(), extents.end(), address, [](uint64_t a, const extent& e) {
+        return a < e.address;
+    });
+
+    if (it != extents.begin() && prev(it)->address + prev(it)->length > address)
+        it--;
+
+    for (; it != extents.end() && it->address < end; it++) {
+        auto first = it->first_ref;
+        auto last = next(it) != extents.end() ? next(it)->first_ref : (uint32_t)refs.size();
+        auto s = max(address, it->address);
+        auto e = min(end, it->address + it->length);
+
+        if (s >= e)
+            continue;
+
+        for (auto i = first; i < last; i++) {
+            add_owners(*it, refs[i], s, e, ret);
+        }
+    }
+
+    if (st) {
+        st->rmap_lookup += chrono::steady_clock::now() - t1;
+        st->rmap_lookups++;
+    }
+
+    return ret;
+}
+
+vector<extent_owner> reverse_map::lookup(const finding& f, stats* st) const {
+    switch (f.type) {
+        case finding_type::discarded_but_used:
+        case finding_type::discarded_but_checksummed:
+        case finding_type::data_csum_mismatch:
+            return lookup(f.address, f.length, st);
+
+        case finding_type::tree_block_discarded:
+            return lookup(f.address, sb.nodesize, st);
+
+        case finding_type::free_and_used:
+            return lookup(f.offset, f.length, st);
+
+        default:
+            return {};
+    }
+}
+
+static string escape_label(string_view s) {
+    string ret;
+
+    for (auto c : s) {
+        switch (c) {
+            case '\\':
+                ret += "\\\\";
+                break;
+
+            case '"':
+                ret += "\\\"";
+                break;
+
+            case '\n':
+                ret += "\\n";
+                break;
+
+            default:
+                ret += c;
+        }
+    }
+
+    return ret;
+}
+
+string discard_check::prometheus_text(const metrics& m, string_view image_name) {
+    string ret;
+    auto image_label = escape_label(image_name);
+
+    ret += "# HELP btrfs_discard_check_free_bytes Bytes of the image which btrfs considers free.\n";
+    ret += "# TYPE btrfs_discard_check_free_bytes gauge\n";
+
+    for (const auto& [k, wm] : m.block_groups) {
+        ret += format("btrfs_discard_check_free_bytes{{image=\"{}\",type=\"{}\",profile=\"{}\"}} {}\n",
+                      image_label, k.first, k.second, wm.free_bytes);
+    }
+
+    ret += "# HELP btrfs_discard_check_wasted_bytes Bytes of the image which btrfs considers free, but which haven't been discarded.\n";
+    ret += "# TYPE btrfs_discard_check_wasted_bytes gauge\n";
+
+    for (const auto& [k, wm] : m.block_groups) {
+        ret += format("btrfs_discard_check_wasted_bytes{{image=\"{}\",type=\"{}\",profile=\"{}\"}} {}\n",
+                      image_label, k.first, k.second, wm.wasted_bytes);
+    }
+
+    ret += "# HELP btrfs_discard_check_at_risk_bytes Bytes of the image which btrfs considers in use, but which have been discarded.\n";
+    ret += "# TYPE btrfs_discard_check_at_risk_bytes gauge\n";
+
+    for (const auto& [k, wm] : m.block_groups) {
+        ret += format("btrfs_discard_check_at_risk_bytes{{image=\"{}\",type=\"{}\",profile=\"{}\"}} {}\n",
+                      image_label, k.first, k.second, wm.at_risk_bytes);
+    }
+
+    ret += "# HELP btrfs_discard_check_leaked_range_bytes Sizes of ranges which are free but haven't been discarded.\n";
+    ret += "# TYPE btrfs_discard_check_leaked_range_bytes histogram\n";
+
+    for (const auto& [k, wm] : m.block_groups) {
+        uint64_t count = 0;
+
+        for (size_t i = 0; i < wm.leaked_ranges.size(); i++) {
+            count += wm.leaked_ranges[i];
+
+            auto le = i < size(leaked_range_buckets) ? to_string(leaked_range_buckets[i]) : "+Inf";
+
+            ret += format("btrfs_discard_check_leaked_range_bytes_bucket{{image=\"{}\",type=\"{}\",profile=\"{}\",le=\"{}\"}} {}\n",
+                          image_label, k.first, k.second, le, count);
+        }
+
+        ret += format("btrfs_discard_check_leaked_range_bytes_sum{{image=\"{}\",type=\"{}\",profile=\"{}\"}} {}\n",
+                      image_label, k.first, k.second, wm.wasted_bytes);
+        ret += format("btrfs_discard_check_leaked_range_bytes_count{{image=\"{}\",type=\"{}\",profile=\"{}\"}} {}\n",
+                      image_label, k.first, k.second, count);
+    }
+
+    return ret;
+}
+
+static const char* finding_type_names[] = {
+    "superblock_not_allocated",
+    "allocated_outside_chunk",
+    "free_space_outside_chunk",
+    "allocated_but_free",
+    "discarded_but_used",
+    "free_space_not_analysed",
+    "data_csum_mismatch",
+    "discarded_but_checksummed",
+    "tree_block_discarded",
+    "free_and_used",
+    "neither_free_nor_used",
+    "block_group_used_mismatch",
+    "block_group_flags_mismatch",
+    "allocated_but_zeroed"
+};
+
+static_assert(size(finding_type_names) == (size_t)finding_type::allocated_but_zeroed + 1);
+
+string discard_check::partial_result_json(const partial_result& pr) {
+    json j;
+
+    j["image"] = pr.image_name;
+    j["image_size"] = pr.image_size;
+    j["range_start"] = pr.range_start;
+    j["range_length"] = pr.range_length;
+    j["findings"] = json::array();
+    j["block_groups"] = json::array();
+
+    for (const auto& f : pr.findings) {
+        j["findings"].push_back({
+            { "type", finding_type_names[(size_t)f.type] },
+            { "offset", f.offset },
+            { "length", f.length },
+            { "address", f.address },
+            { "expected", f.expected },
+            { "actual", f.actual }
+        });
+    }
+
+    for (const auto& [k, wm] : pr.m.block_groups) {
+        j["block_groups"].push_back({
+            { "type", k.first },
+            { "profile", k.second },
+            { "free_bytes", wm.free_bytes },
+            { "wasted_bytes", wm.wasted_bytes },
+            { "at_risk_bytes", wm.at_risk_bytes },
+            { "leaked_ranges", wm.leaked_ranges }
+        });
+    }
+
+    return j.dump(1) + "\n";
+}
+
+partial_result discard_check::parse_partial_result(string_view s) {
+    auto j = json::parse(s);
+    partial_result pr;
+
+    if (j.type() != json::value_t::object)
+        throw runtime_error("partial result was not a JSON object");
+
+    pr.image_name = j.at("image").get<string>();
+    pr.image_size = j.at("image_size").get<uint64_t>();
+    pr.range_start = j.at("range_start").get<uint64_t>();
+    pr.range_length = j.at("range_length").get<uint64_t>();
+
+    for (const auto& f : j.at("findings")) {
+        auto type = f.at("type").get<string>();
+        auto it = find(begin(finding_type_names), end(finding_type_names), type);
+
+        if (it == end(finding_type_names))
+            throw formatted_error("unrecognized finding type {}", type);
+
+        pr.findings.emplace_back((finding_type)(it - begin(finding_type_names)),
+                                 f.at("offset").get<uint64_t>(), f.at("length").get<uint64_t>(),
+                                 f.at("address").get<uint64_t>(), f.at("expected").get<uint64_t>(),
+                                 f.at("actual").get<uint64_t>());
+    }
+
+    for (const auto& bg : j.at("block_groups")) {
+        auto& wm = pr.m.block_groups[make_pair(bg.at("type").get<string>(),
+                                               bg.at("profile").get<string>())];
+
+        wm.free_bytes = bg.at("free_bytes").get<uint64_t>();
+        wm.wasted_bytes = bg.at("wasted_bytes").get<uint64_t>();
+        wm.at_risk_bytes = bg.at("at_risk_bytes").get<uint64_t>();
+
+        const auto& lr = bg.at("leaked_ranges");
+
+        if (lr.size() != wm.leaked_ranges.size())
+            throw runtime_error("partial result has wrong number of leaked range buckets");
+
+        for (size_t i = 0; i < wm.leaked_ranges.size(); i++) {
+            wm.leaked_ranges[i] = lr[i].get<uint64_t>();
+        }
+    }
+
+    return pr;
+}
+
+// Combines the results of checking several ranges of the same image. The
+// checks which aren't split by range get done by every shard, so findings
+// which come up more than once are only kept once.
+partial_result discard_check::merge_partial_results(vector<partial_result> parts) {
+    partial_result ret;
+
+    if (parts.empty())
+        return ret;
+
+    sort(parts.begin(), parts.end(), [](const partial_result& a, const partial_result& b) {
+        return a.range_start < b.range_start;
+    });
+
+    ret.image_name = parts.front().image_name;
+    ret.image_size = parts.front().image_size;
+    ret.range_start = parts.front().range_start;
+
+    uint64_t end = ret.range_start;
+
+    for (auto& p : parts) {
+        if (p.image_size != ret.image_size) {
+            throw formatted_error("partial results are for different sizes of image ({:x} and {:x})",
+                                  ret.image_size, p.image_size);
+        }
+
+        if (p.range_start < end)
+            throw formatted_error("partial results overlap at {:x}", p.range_start);
+        else if (p.range_start > end)
+            throw formatted_error("no partial result for {:x} to {:x}", end, p.range_start);
+
+        end = p.range_start + p.range_length;
+
+        ret.findings.insert(ret.findings.end(), p.findings.begin(), p.findings.end());
+
+        for (const auto& [k, wm] : p.m.block_groups) {
+            ret.m.block_groups[k] += wm;
+        }
+    }
+
+    ret.range_length = end - ret.range_start;
+
+    auto key = [](const finding& f) {
+        return make_tuple(f.offset, f.type, f.length, f.address, f.expected, f.actual);
+    };
+
+    sort(ret.findings.begin(), ret.findings.end(), [&key](const finding& a, const finding& b) {
+        return key(a) < key(b);
+    });
+
+    ret.findings.erase(unique(ret.findings.begin(), ret.findings.end(), [&key](const finding& a, const finding& b) {
+        return key(a) == key(b);
+    }), ret.findings.end());
+
+    return ret;
+}
+
+template<>
+struct std::formatter<discard_check::finding> {
+    constexpr auto parse(format_parse_context& ctx) {
+        auto it = ctx.begin();
+
+        if (it != ctx.end() && *it != '}')
+            throw format_error("invalid format");
+
+        return it;
+    }
+
+    template<typename format_context>
+    auto format(const discard_check::finding& f, format_context& ctx) const {
+        switch (f.type) {
+            case finding_type::superblock_not_allocated:
+                return format_to(ctx.out(), "superblock at {:x} not allocated", f.offset);
+            case finding_type::allocated_outside_chunk:
+                return format_to(ctx.out(), "qcow range {:x}, {:x} allocated but not part of any btrfs chunk",
+                                 f.offset, f.length);
+            case finding_type::free_space_outside_chunk:
+                return format_to(ctx.out(), "free space entry {:x}, {:x} not part of any chunk",
+                                 f.offset, f.length);
+            case finding_type::allocated_but_free:
+                return format_to(ctx.out(), "qcow range {:x}, {:x} allocated (address {:x}) but is free space",
+                                 f.offset, f.length, f.address);
+            case finding_type::discarded_but_used:
+                return format_to(ctx.out(), "qcow range {:x}, {:x} discarded (address {:x}) but is allocated",
+                                 f.offset, f.length, f.address);
+            case finding_type::free_space_not_analysed:
+                return format_to(ctx.out(), "not analysing free space as filesystem is not using free space tree");
+            case finding_type::discarded_but_checksummed:
+                return format_to(ctx.out(), "qcow range {:x}, {:x} discarded (address {:x}) but has checksums",
+                                 f.offset, f.length, f.address);
+            case finding_type::tree_block_discarded:
+                return format_to(ctx.out(), "qcow range {:x}, {:x} discarded but is tree block {:x}",
+                                 f.offset, f.length, f.address);
+            case finding_type::free_and_used:
+                return format_to(ctx.out(), "range {:x}, {:x} in block group {:x} is both free space and in the extent tree",
+                                 f.offset, f.length, f.address);
+            case finding_type::neither_free_nor_used:
+                return format_to(ctx.out(), "range {:x}, {:x} in block group {:x} is neither free space nor in the extent tree",
+                                 f.offset, f.length, f.address);
+            case finding_type::block_group_used_mismatch:
+                return format_to(ctx.out(), "block group {:x} has {:x} bytes used, but {:x} bytes aren't free space",
+                                 f.address, f.actual, f.expected);
+            case finding_type::block_group_flags_mismatch:
+                return format_to(ctx.out(), "block group {:x} has flags {:x}, but its chunk has type {:x}",
+                                 f.address, f.actual, f.expected);
+            case finding_type::allocated_but_zeroed:
+                return format_to(ctx.out(), "qcow range {:x}, {:x} allocated (address {:x}) but is free space, and is all zeroes",
+                                 f.offset, f.length, f.address);
+            case finding_type::data_csum_mismatch:
+                return format_to(ctx.out(), "data at address {:x}, length {:x} (qcow offset {:x}) does not match its checksum",
+                                 f.address, f.length, f.offset);
+            default:
+                return format_to(ctx.out(), "{}", (unsigned int)f.type);
+        }
+    }
+};
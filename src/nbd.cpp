@@ -0,0 +1,795 @@
+module;
+
+#include <string>
+#include <string_view>
+#include <span>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <format>
+#include <cstring>
+#include <stdint.h>
+#include <endian.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+export module nbd;
+
+import discard_check;
+import formatted_error;
+
+using namespace std;
+
+static const uint64_t NBD_MAGIC = 0x4e42444d41474943; // "NBDMAGIC"
+static const uint64_t NBD_OPTS_MAGIC = 0x49484156454f5054; // "IHAVEOPT"
+static const uint64_t NBD_REP_MAGIC = 0x3e889045565a9;
+static const uint32_t NBD_REQUEST_MAGIC = 0x25609513;
+static const uint32_t NBD_SIMPLE_REPLY_MAGIC = 0x67446698;
+static const uint32_t NBD_STRUCTURED_REPLY_MAGIC = 0x668e33ef;
+
+static const uint16_t NBD_FLAG_FIXED_NEWSTYLE = 1 << 0;
+static const uint16_t NBD_FLAG_NO_ZEROES = 1 << 1;
+
+static const uint32_t NBD_OPT_GO = 7;
+static const uint32_t NBD_OPT_STRUCTURED_REPLY = 8;
+static const uint32_t NBD_OPT_SET_META_CONTEXT = 10;
+
+static const uint32_t NBD_REP_ACK = 1;
+static const uint32_t NBD_REP_INFO = 3;
+static const uint32_t NBD_REP_META_CONTEXT = 4;
+static const uint32_t NBD_REP_FLAG_ERROR = 1u << 31;
+
+static const uint16_t NBD_INFO_EXPORT = 0;
+
+static const uint16_t NBD_CMD_READ = 0;
+static const uint16_t NBD_CMD_DISC = 2;
+static const uint16_t NBD_CMD_BLOCK_STATUS = 7;
+
+static const uint16_t NBD_REPLY_FLAG_DONE = 1 << 0;
+
+static const uint16_t NBD_REPLY_TYPE_NONE = 0;
+static const uint16_t NBD_REPLY_TYPE_OFFSET_DATA = 1;
+static const uint16_t NBD_REPLY_TYPE_OFFSET_HOLE = 2;
+static const uint16_t NBD_REPLY_TYPE_BLOCK_STATUS = 5;
+static const uint16_t NBD_REPLY_TYPE_ERROR_BIT = 1 << 15;
+
+static const uint32_t NBD_STATE_HOLE = 1 << 0;
+static const uint32_t NBD_STATE_ZERO = 1 << 1;
+
+static const uint16_t NBD_DEFAULT_PORT = 10809;
+
+export namespace discard_check {
+
+// Image exported over NBD, e.g. by qemu-nbd, so that allocation can be
+// queried while it's still being served rather than with qemu-img.
+class nbd : public image {
+public:
+    nbd(string_view uri);
+    ~nbd();
+    void read(uint64_t offset, span<uint8_t> buf) const override;
+    vector<qcow_map> alloc_map(uint64_t start, uint64_t length) const override;
+
+    uint64_t size() const override {
+        return export_size;
+    }
+
+private:
+    using reply_func = function<void(size_t, uint16_t, span<const uint8_t>)>;
+
+    // The requests made by one call of run_requests.
+    struct batch {
+        const reply_func& func;
+        size_t in_flight = 0;
+        exception_ptr error;
+    };
+
+    struct request {
+        batch* b;
+        size_t piece;
+        uint16_t type;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    void connect_unix(const string& path);
+    void connect_tcp(const string& host, const string& port);
+    void handshake(const string& export_name);
+    void send_option(uint32_t option, span<const uint8_t> data);
+    uint32_t recv_option_reply(uint32_t option, vector<uint8_t>& data);
+    void run_requests(uint16_t type, span<const pair<uint64_t, uint64_t>> pieces,
+                      const reply_func& func) const;
+    void receive_replies();
+    void finish_request(uint64_t cookie);
+
+    int fd = -1;
+    uint64_t export_size = 0;
+    uint32_t context_id = 0;
+    mutable mutex send_mutex;
+    mutable mutex mut;
+    mutable condition_variable cv;
+    mutable uint64_t next_cookie = 1;
+    mutable map<uint64_t, request> in_flight; // by cookie
+    exception_ptr connection_error;
+    jthread receiver;
+};
+
+bool is_nbd_uri(string_view s) {
+    return s.starts_with("nbd://") || s.starts_with("nbd+unix://");
+}
+
+}
+
+using namespace discard_check;
+
+static void send_all(int fd, span<const uint8_t> buf) {
+    while (!buf.empty()) {
+        auto ret = send(fd, buf.data(), buf.size(), MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw formatted_error("send failed (errno {})", errno);
+        }
+
+        buf = buf.subspan(ret);
+    }
+}
+
+static void recv_all(int fd, span<uint8_t> buf) {
+    while (!buf.empty()) {
+        auto ret = recv(fd, buf.data(), buf.size(), 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw formatted_error("recv failed (errno {})", errno);
+        }
+
+        if (ret == 0)
+            throw runtime_error("NBD server closed connection");
+
+        buf = buf.subspan(ret);
+    }
+}
+
+static void put_be16(vector<uint8_t>& v, uint16_t n) {
+    n = htobe16(n);
+    v.insert(v.end(), (uint8_t*)&n, (uint8_t*)&n + sizeof(n));
+}
+
+static void put_be32(vector<uint8_t>& v, uint32_t n) {
+    n = htobe32(n);
+    v.insert(v.end(), (uint8_t*)&n, (uint8_t*)&n + sizeof(n));
+}
+
+static void put_be64(vector<uint8_t>& v, uint64_t n) {
+    n = htobe64(n);
+    v.insert(v.end(), (uint8_t*)&n, (uint8_t*)&n + sizeof(n));
+}
+
+static uint16_t get_be16(span<const uint8_t> sp) {
+    uint16_t n;
+
+    memcpy(&n, sp.data(), sizeof(n));
+
+    return be16toh(n);
+}
+
+static uint32_t get_be32(span<const uint8_t> sp) {
+    uint32_t n;
+
+    memcpy(&n, sp.data(), sizeof(n));
+
+    return be32toh(n);
+}
+
+static uint64_t get_be64(span<const uint8_t> sp) {
+    uint64_t n;
+
+    memcpy(&n, sp.data(), sizeof(n));
+
+    return be64toh(n);
+}
+
+nbd::nbd(string_view uri) {
+    string export_name;
+
+    // nbd+unix:///<export>?socket=<path>, or nbd://<host>[:<port>][/<export>]
+
+    if (uri.starts_with("nbd+unix://")) {
+        auto rest = uri.substr(string_view("nbd+unix://").size());
+        auto q = rest.find("?socket=");
+
+        if (q == string_view::npos)
+            throw formatted_error("NBD URI {} has no socket parameter", uri);
+
+        auto path = rest.substr(0, q);
+
+        if (path.starts_with("/"))
+            path = path.substr(1);
+
+        export_name = path;
+        connect_unix(string(rest.substr(q + string_view("?socket=").size())));
+    } else if (uri.starts_with("nbd://")) {
+        auto rest = uri.substr(string_view("nbd://").size());
+        auto slash = rest.find('/');
+        auto authority = rest.substr(0, slash);
+        string port = to_string(NBD_DEFAULT_PORT);
+
+        if (slash != string_view::npos)
+            export_name = rest.substr(slash + 1);
+
+        if (auto colon = authority.rfind(':'); colon != string_view::npos &&
+            authority.find(']', colon) == string_view::npos) {
+            port = authority.substr(colon + 1);
+            authority = authority.substr(0, colon);
+        }
+
+        if (authority.starts_with("[") && authority.ends_with("]"))
+            authority = authority.substr(1, authority.size() - 2);
+
+        connect_tcp(string(authority), port);
+    } else
+        throw formatted_error("unrecognized NBD URI {}", uri);
+
+    try {
+        handshake(export_name);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    receiver = jthread([this]() {
+        receive_replies();
+    });
+}
+
+nbd::~nbd() {
+    vector<uint8_t> req;
+
+    put_be32(req, NBD_REQUEST_MAGIC);
+    put_be16(req, 0);
+    put_be16(req, NBD_CMD_DISC);
+    put_be64(req, 0);
+    put_be64(req, 0);
+    put_be32(req, 0);
+
+    try {
+        lock_guard lg(send_mutex);
+
+        send_all(fd, req);
+    } catch (...) {
+    }
+
+    // wake up the receiver thread, so it can finish
+
+    shutdown(fd, SHUT_RDWR);
+    receiver.join();
+
+    close(fd);
+}
+
+void nbd::connect_unix(const string& path) {
+    struct sockaddr_un addr;
+
+    if (path.size() >= sizeof(addr.sun_path))
+        throw formatted_error("socket path {} too long", path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        throw formatted_error("socket failed (errno {})", errno);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        auto err = errno;
+
+        close(fd);
+        throw formatted_error("could not connect to {} (errno {})", path, err);
+    }
+}
+
+void nbd::connect_tcp(const string& host, const string& port) {
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    auto ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+
+    if (ret != 0)
+        throw formatted_error("could not resolve {}: {}", host, gai_strerror(ret));
+
+    for (auto ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+        if (fd < 0)
+            continue;
+
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        throw formatted_error("could not connect to {} port {}", host, port);
+}
+
+void nbd::send_option(uint32_t option, span<const uint8_t> data) {
+    vector<uint8_t> buf;
+
+    put_be64(buf, NBD_OPTS_MAGIC);
+    put_be32(buf, option);
+    put_be32(buf, (uint32_t)data.size());
+    buf.insert(buf.end(), data.begin(), data.end());
+
+    send_all(fd, buf);
+}
+
+uint32_t nbd::recv_option_reply(uint32_t option, vector<uint8_t>& data) {
+    uint8_t hdr[20];
+
+    recv_all(fd, hdr);
+
+    if (get_be64(hdr) != NBD_REP_MAGIC)
+        throw runtime_error("NBD option reply had wrong magic");
+
+    if (get_be32(span(hdr).subspan(8)) != option) {
+        throw formatted_error("NBD option reply was for option {}, expected {}",
+                              get_be32(span(hdr).subspan(8)), option);
+    }
+
+    data.resize(get_be32(span(hdr).subspan(16)));
+    recv_all(fd, data);
+
+    return get_be32(span(hdr).subspan(12));
+}
+
+void nbd::handshake(const string& export_name) {
+    static const string_view context_name = "base:allocation";
+
+    uint8_t hello[18];
+
+    recv_all(fd, hello);
+
+    if (get_be64(hello) != NBD_MAGIC || get_be64(span(hello).subspan(8)) != NBD_OPTS_MAGIC)
+        throw runtime_error("NBD server does not support newstyle negotiation");
+
+    auto flags = get_be16(span(hello).subspan(16));
+
+    if (!(flags & NBD_FLAG_FIXED_NEWSTYLE))
+        throw runtime_error("NBD server does not support fixed newstyle negotiation");
+
+    vector<uint8_t> buf, reply;
+
+    put_be32(buf, NBD_FLAG_FIXED_NEWSTYLE | (flags & NBD_FLAG_NO_ZEROES));
+    send_all(fd, buf);
+
+    // block status replies are only available as structured replies
+
+    send_option(NBD_OPT_STRUCTURED_REPLY, {});
+
+    if (recv_option_reply(NBD_OPT_STRUCTURED_REPLY, reply) != NBD_REP_ACK)
+        throw runtime_error("NBD server does not support structured replies");
+
+    buf.clear();
+    put_be32(buf, (uint32_t)export_name.size());
+    buf.insert(buf.end(), export_name.begin(), export_name.end());
+    put_be32(buf, 1);
+    put_be32(buf, (uint32_t)context_name.size());
+    buf.insert(buf.end(), context_name.begin(), context_name.end());
+
+    send_option(NBD_OPT_SET_META_CONTEXT, buf);
+
+    bool found_context = false;
+
+    while (true) {
+        auto type = recv_option_reply(NBD_OPT_SET_META_CONTEXT, reply);
+
+        if (type == NBD_REP_ACK)
+            break;
+        else if (type & NBD_REP_FLAG_ERROR)
+            throw formatted_error("NBD server returned error {:x} for SET_META_CONTEXT", type);
+        else if (type == NBD_REP_META_CONTEXT && reply.size() >= sizeof(uint32_t)) {
+            auto name = string_view((char*)reply.data() + sizeof(uint32_t),
+                                    reply.size() - sizeof(uint32_t));
+
+            if (name == context_name) {
+                context_id = get_be32(reply);
+                found_context = true;
+            }
+        }
+    }
+
+    if (!found_context)
+        throw formatted_error("NBD server does not support {}", context_name);
+
+    buf.clear();
+    put_be32(buf, (uint32_t)export_name.size());
+    buf.insert(buf.end(), export_name.begin(), export_name.end());
+    put_be16(buf, 0); // no information requests beyond the default
+
+    send_option(NBD_OPT_GO, buf);
+
+    bool found_size = false;
+
+    while (true) {
+        auto type = recv_option_reply(NBD_OPT_GO, reply);
+
+        if (type == NBD_REP_ACK)
+            break;
+        else if (type & NBD_REP_FLAG_ERROR)
+            throw formatted_error("NBD server returned error {:x} for export \"{}\"", type, export_name);
+        else if (type == NBD_REP_INFO && reply.size() >= sizeof(uint16_t) + sizeof(uint64_t) &&
+                 get_be16(reply) == NBD_INFO_EXPORT) {
+            export_size = get_be64(span(reply).subspan(sizeof(uint16_t)));
+            found_size = true;
+        }
+    }
+
+    if (!found_size)
+        throw runtime_error("NBD server did not tell us the size of the export");
+}
+
+// Sends a request for each piece, keeping several in flight at once so we're
+// not waiting on a round trip each time, and calls func for each chunk of the
+// replies with the index of the piece it belongs to. The replies are read by
+// the receiver thread, so several threads can have requests in flight on the
+// same connection at once; func is only ever called by one thread at a time.
+void nbd::run_requests(uint16_t type, span<const pair<uint64_t, uint64_t>> pieces,
+                       const reply_func& func) const {
+    static const size_t MAX_IN_FLIGHT = 16;
+
+    batch b{func, 0, nullptr};
+    size_t next_piece = 0;
+
+    while (true) {
+        vector<pair<uint64_t, size_t>> to_send; // cookie and piece
+
+        {
+            unique_lock ul(mut);
+
+            cv.wait(ul, [&]() {
+                return connection_error || b.in_flight < MAX_IN_FLIGHT || next_piece == pieces.size();
+            });
+
+            if (connection_error) {
+                // the receiver has given up, so nothing more is coming
+                cv.wait(ul, [&]() { return b.in_flight == 0; });
+                rethrow_exception(connection_error);
+            }
+
+            if (next_piece == pieces.size()) {
+                cv.wait(ul, [&]() { return b.in_flight == 0; });
+                break;
+            }
+
+            while (next_piece < pieces.size() && b.in_flight < MAX_IN_FLIGHT) {
+                auto cookie = next_cookie++;
+
+                in_flight.emplace(cookie, request{&b, next_piece, type, pieces[next_piece].first,
+                                                  pieces[next_piece].second});
+                b.in_flight++;
+                to_send.emplace_back(cookie, next_piece);
+                next_piece++;
+            }
+        }
+
+        vector<uint8_t> req;
+
+        for (const auto& [cookie, i] : to_send) {
+            put_be32(req, NBD_REQUEST_MAGIC);
+            put_be16(req, 0);
+            put_be16(req, type);
+            put_be64(req, cookie);
+            put_be64(req, pieces[i].first);
+            put_be32(req, (uint32_t)pieces[i].second);
+        }
+
+        try {
+            lock_guard lg(send_mutex);
+
+            send_all(fd, req);
+        } catch (...) {
+            // we don't know how much got through, so the connection is no good
+            shutdown(fd, SHUT_RDWR);
+
+            unique_lock ul(mut);
+
+            cv.wait(ul, [&]() { return b.in_flight == 0; });
+            throw;
+        }
+    }
+
+    if (b.error)
+        rethrow_exception(b.error);
+}
+
+void nbd::finish_request(uint64_t cookie) {
+    lock_guard lg(mut);
+
+    auto it = in_flight.find(cookie);
+
+    it->second.b->in_flight--;
+    in_flight.erase(it);
+
+    cv.notify_all();
+}
+
+// Runs on its own thread, reading replies and passing them on to whichever
+// batch the request was part of. If anything goes wrong with the connection,
+// everything still waiting fails.
+void nbd::receive_replies() {
+    vector<uint8_t> payload;
+
+    try {
+        while (true) {
+            uint8_t magic[4];
+
+            recv_all(fd, magic);
+
+            uint64_t cookie;
+            uint16_t flags, reply_type;
+            uint32_t error = 0;
+
+            if (get_be32(magic) == NBD_SIMPLE_REPLY_MAGIC) {
+                uint8_t hdr[12];
+
+                recv_all(fd, hdr);
+
+                error = get_be32(hdr);
+                cookie = get_be64(span(hdr).subspan(4));
+                flags = NBD_REPLY_FLAG_DONE;
+                reply_type = error != 0 ? NBD_REPLY_TYPE_ERROR_BIT : NBD_REPLY_TYPE_NONE;
+            } else if (get_be32(magic) == NBD_STRUCTURED_REPLY_MAGIC) {
+                uint8_t hdr[16];
+
+                recv_all(fd, hdr);
+
+                flags = get_be16(hdr);
+                reply_type = get_be16(span(hdr).subspan(2));
+                cookie = get_be64(span(hdr).subspan(4));
+
+                payload.resize(get_be32(span(hdr).subspan(12)));
+            } else
+                throw formatted_error("NBD reply had unexpected magic {:x}", get_be32(magic));
+
+            request r;
+
+            {
+                lock_guard lg(mut);
+
+                auto it = in_flight.find(cookie);
+
+                if (it == in_flight.end())
+                    throw formatted_error("NBD reply for unknown cookie {:x}", cookie);
+
+                r = it->second;
+            }
+
+            // A simple reply to a read has the data straight after it - we
+            // have to read it even if we're not going to use it, so that we
+            // don't lose our place in the stream.
+
+            if (get_be32(magic) == NBD_SIMPLE_REPLY_MAGIC) {
+                if (r.type == NBD_CMD_READ && error == 0) {
+                    payload.clear();
+                    put_be64(payload, r.offset);
+                    payload.resize(sizeof(uint64_t) + r.length);
+                    recv_all(fd, span(payload).subspan(sizeof(uint64_t)));
+                    reply_type = NBD_REPLY_TYPE_OFFSET_DATA;
+                } else
+                    payload.clear();
+            } else
+                recv_all(fd, payload);
+
+            try {
+                if (reply_type & NBD_REPLY_TYPE_ERROR_BIT) {
+                    string msg;
+
+                    if (payload.size() >= sizeof(uint32_t))
+                        error = get_be32(payload);
+
+                    if (payload.size() >= sizeof(uint32_t) + sizeof(uint16_t)) {
+                        auto len = min((size_t)get_be16(span(payload).subspan(sizeof(uint32_t))),
+                                       payload.size() - sizeof(uint32_t) - sizeof(uint16_t));
+
+                        msg = string((char*)payload.data() + sizeof(uint32_t) + sizeof(uint16_t), len);
+                    }
+
+                    throw formatted_error("NBD request failed (error {}): {}", error, msg);
+                }
+
+                if (reply_type != NBD_REPLY_TYPE_NONE)
+                    r.b->func(r.piece, reply_type, payload);
+            } catch (...) {
+                // only the first error of each batch gets passed on
+                if (!r.b->error)
+                    r.b->error = current_exception();
+            }
+
+            if (flags & NBD_REPLY_FLAG_DONE)
+                finish_request(cookie);
+        }
+    } catch (...) {
+        lock_guard lg(mut);
+
+        connection_error = current_exception();
+
+        for (auto& [cookie, r] : in_flight) {
+            if (!r.b->error)
+                r.b->error = connection_error;
+
+            r.b->in_flight--;
+        }
+
+        in_flight.clear();
+        cv.notify_all();
+    }
+}
+
+void nbd::read(uint64_t offset, span<uint8_t> buf) const {
+    static const uint64_t MAX_READ = 0x2000000; // 32 MiB, the most qemu-nbd will do at once
+
+    vector<pair<uint64_t, uint64_t>> pieces;
+
+    for (uint64_t pos = 0; pos < buf.size(); pos += MAX_READ) {
+        pieces.emplace_back(offset + pos, min(MAX_READ, buf.size() - pos));
+    }
+
+    // the chunks of each reply, so that we can make sure nothing's missing
+    vector<vector<pair<uint64_t, uint64_t>>> covered(pieces.size());
+
+    run_requests(NBD_CMD_READ, pieces, [&](size_t i, uint16_t type, span<const uint8_t> payload) {
+        const auto& p = pieces[i];
+
+        if (payload.size() < sizeof(uint64_t))
+            throw runtime_error("NBD read reply truncated");
+
+        auto chunk_offset = get_be64(payload);
+        uint64_t length;
+
+        if (type == NBD_REPLY_TYPE_OFFSET_DATA)
+            length = payload.size() - sizeof(uint64_t);
+        else if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            if (payload.size() < sizeof(uint64_t) + sizeof(uint32_t))
+                throw runtime_error("NBD read reply truncated");
+
+            length = get_be32(payload.subspan(sizeof(uint64_t)));
+        } else
+            throw formatted_error("unexpected NBD reply type {} for read", type);
+
+        if (chunk_offset < p.first || chunk_offset + length > p.first + p.second)
+            throw formatted_error("NBD read reply for {:x}, {:x} out of range", chunk_offset, length);
+
+        covered[i].emplace_back(chunk_offset, length);
+
+        auto dest = buf.subspan(chunk_offset - offset, length);
+
+        if (type == NBD_REPLY_TYPE_OFFSET_DATA)
+            memcpy(dest.data(), payload.data() + sizeof(uint64_t), length);
+        else
+            memset(dest.data(), 0, length);
+    });
+
+    for (size_t i = 0; i < pieces.size(); i++) {
+        auto& c = covered[i];
+        auto pos = pieces[i].first;
+
+        ranges::sort(c);
+
+        for (const auto& [chunk_offset, length] : c) {
+            if (chunk_offset != pos)
+                break;
+
+            pos += length;
+        }
+
+        if (pos != pieces[i].first + pieces[i].second) {
+            throw formatted_error("NBD read reply for {:x}, {:x} did not cover {:x}",
+                                  pieces[i].first, pieces[i].second, pos);
+        }
+    }
+}
+
+vector<qcow_map> nbd::alloc_map(uint64_t start, uint64_t length) const {
+    // the length field is only 32 bits, so ask for as much as we can in one go
+    static const uint64_t MAX_STATUS = 0x80000000;
+
+    map<uint64_t, qcow_map> extents;
+    vector<pair<uint64_t, uint64_t>> pieces;
+    auto end = start + length;
+
+    for (auto pos = start; pos < end; pos += MAX_STATUS) {
+        pieces.emplace_back(pos, min(MAX_STATUS, end - pos));
+    }
+
+    // The server can return less than we asked for, in which case ask again
+    // for the rest.
+
+    while (!pieces.empty()) {
+        vector<uint64_t> reached(pieces.size());
+
+        for (size_t i = 0; i < pieces.size(); i++) {
+            reached[i] = pieces[i].first;
+        }
+
+        run_requests(NBD_CMD_BLOCK_STATUS, pieces, [&](size_t i, uint16_t type, span<const uint8_t> payload) {
+            if (type != NBD_REPLY_TYPE_BLOCK_STATUS)
+                throw formatted_error("unexpected NBD reply type {} for block status", type);
+
+            if (payload.size() < sizeof(uint32_t) || get_be32(payload) != context_id)
+                return;
+
+            payload = payload.subspan(sizeof(uint32_t));
+
+            auto piece_end = pieces[i].first + pieces[i].second;
+
+            while (payload.size() >= 2 * sizeof(uint32_t) && reached[i] < piece_end) {
+                auto len = min((uint64_t)get_be32(payload), piece_end - reached[i]);
+                auto flags = get_be32(payload.subspan(sizeof(uint32_t)));
+
+                if (len == 0)
+                    throw runtime_error("NBD block status returned zero-length extent");
+
+                extents[reached[i]] = qcow_map{!(flags & NBD_STATE_HOLE), true,
+                                               (flags & NBD_STATE_ZERO) != 0,
+                                               reached[i], len, reached[i]};
+
+                reached[i] += len;
+                payload = payload.subspan(2 * sizeof(uint32_t));
+            }
+        });
+
+        vector<pair<uint64_t, uint64_t>> rest;
+
+        for (size_t i = 0; i < pieces.size(); i++) {
+            auto piece_end = pieces[i].first + pieces[i].second;
+
+            if (reached[i] == pieces[i].first) {
+                throw formatted_error("NBD block status for {:x}, {:x} returned nothing",
+                                      pieces[i].first, pieces[i].second);
+            }
+
+            if (reached[i] < piece_end)
+                rest.emplace_back(reached[i], piece_end - reached[i]);
+        }
+
+        pieces.swap(rest);
+    }
+
+    // join up adjacent extents with the same status
+
+    vector<qcow_map> ret;
+
+    for (const auto& e : extents) {
+        const auto& m = e.second;
+
+        if (!ret.empty() && ret.back().start + ret.back().length == m.start &&
+            ret.back().data == m.data && ret.back().zero == m.zero) {
+            ret.back().length += m.length;
+        } else
+            ret.push_back(m);
+    }
+
+    return ret;
+}
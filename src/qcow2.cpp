@@ -0,0 +1,282 @@
+module;
+
+#include <stdint.h>
+#include <endian.h>
+#include <span>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cstddef>
+
+export module qcow2;
+
+using namespace std;
+
+export namespace qcow2 {
+
+template<typename T>
+class big_endian {
+public:
+    operator T() const {
+        if constexpr (sizeof(T) == 1)
+            return val;
+        else if constexpr (sizeof(T) == 2)
+            return be16toh(val);
+        else if constexpr (sizeof(T) == 4)
+            return be32toh(val);
+        else
+            return be64toh(val);
+    }
+
+    big_endian& operator=(T t) {
+        if constexpr (sizeof(T) == 1)
+            val = t;
+        else if constexpr (sizeof(T) == 2)
+            val = htobe16(t);
+        else if constexpr (sizeof(T) == 4)
+            val = htobe32(t);
+        else
+            val = htobe64(t);
+
+        return *this;
+    }
+
+private:
+    T val;
+} __attribute__((packed));
+
+constexpr uint32_t MAGIC = 0x514649fb; // "QFI\xfb"
+
+constexpr uint64_t INCOMPAT_DIRTY = 1 << 0;
+constexpr uint64_t INCOMPAT_CORRUPT = 1 << 1;
+constexpr uint64_t INCOMPAT_DATA_FILE = 1 << 2;
+constexpr uint64_t INCOMPAT_COMPRESSION = 1 << 3;
+constexpr uint64_t INCOMPAT_EXTL2 = 1 << 4;
+
+constexpr uint64_t L1E_OFFSET_MASK = 0x00fffffffffffe00;
+constexpr uint64_t L2E_OFFSET_MASK = 0x00fffffffffffe00;
+constexpr uint64_t REFT_OFFSET_MASK = 0xfffffffffffffe00;
+
+constexpr uint64_t OFLAG_COPIED = 1ull << 63;
+constexpr uint64_t OFLAG_COMPRESSED = 1ull << 62;
+constexpr uint64_t OFLAG_ZERO = 1ull << 0;
+
+// Version 2 headers stop at incompatible_features.
+constexpr uint32_t V2_HEADER_LENGTH = 72;
+
+constexpr uint32_t EXT_END = 0;
+constexpr uint32_t EXT_BACKING_FORMAT = 0xe2792aca;
+
+// The maximum length of a backing file name.
+constexpr uint32_t MAX_BACKING_FILE_SIZE = 1023;
+
+struct header {
+    big_endian<uint32_t> magic;
+    big_endian<uint32_t> version;
+    big_endian<uint64_t> backing_file_offset;
+    big_endian<uint32_t> backing_file_size;
+    big_endian<uint32_t> cluster_bits;
+    big_endian<uint64_t> size;
+    big_endian<uint32_t> crypt_method;
+    big_endian<uint32_t> l1_size;
+    big_endian<uint64_t> l1_table_offset;
+    big_endian<uint64_t> refcount_table_offset;
+    big_endian<uint32_t> refcount_table_clusters;
+    big_endian<uint32_t> nb_snapshots;
+    big_endian<uint64_t> snapshots_offset;
+    big_endian<uint64_t> incompatible_features;
+    big_endian<uint64_t> compatible_features;
+    big_endian<uint64_t> autoclear_features;
+    big_endian<uint32_t> refcount_order;
+    big_endian<uint32_t> header_length;
+    uint8_t compression_type;
+    uint8_t padding[7];
+} __attribute__((packed));
+
+static_assert(sizeof(header) == 112);
+
+struct header_extension {
+    big_endian<uint32_t> type;
+    big_endian<uint32_t> length;
+} __attribute__((packed));
+
+struct snapshot_header {
+    big_endian<uint64_t> l1_table_offset;
+    big_endian<uint32_t> l1_size;
+    big_endian<uint16_t> id_str_size;
+    big_endian<uint16_t> name_size;
+    big_endian<uint32_t> date_sec;
+    big_endian<uint32_t> date_nsec;
+    big_endian<uint64_t> vm_clock_nsec;
+    big_endian<uint32_t> vm_state_size;
+    big_endian<uint32_t> extra_data_size;
+} __attribute__((packed));
+
+static_assert(sizeof(snapshot_header) == 40);
+
+struct snapshot_extra {
+    big_endian<uint64_t> vm_state_size_large;
+    big_endian<uint64_t> disk_size;
+    big_endian<uint64_t> icount;
+} __attribute__((packed));
+
+struct snapshot {
+    string id;
+    string name;
+    uint64_t l1_table_offset;
+    uint32_t l1_size;
+    uint64_t disk_size;
+};
+
+enum class cluster_state : uint8_t {
+    unallocated,
+    zero,
+    data
+};
+
+struct cluster_run {
+    uint64_t guest_offset;
+    uint64_t length;
+    uint64_t host_offset; // only for data
+    cluster_state state;
+};
+
+// Appends a run, joining it to the previous one if it carries straight on.
+void add_run(vector<cluster_run>& runs, const cluster_run& r) {
+    if (!runs.empty()) {
+        auto& l = runs.back();
+
+        if (l.state == r.state && l.guest_offset + l.length == r.guest_offset &&
+            (r.state != cluster_state::data || l.host_offset + l.length == r.host_offset)) {
+            l.length += r.length;
+            return;
+        }
+    }
+
+    runs.push_back(r);
+}
+
+// Parses an L2 table covering the guest range starting at guest_start, not
+// going past virtual_size.
+void parse_l2(span<const uint8_t> table, uint64_t guest_start, uint32_t cluster_bits,
+              uint64_t virtual_size, vector<cluster_run>& runs) {
+    auto cluster_size = (uint64_t)1 << cluster_bits;
+    auto entries = span((const big_endian<uint64_t>*)table.data(), table.size() / sizeof(uint64_t));
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto guest = guest_start + (i * cluster_size);
+
+        if (guest >= virtual_size)
+            break;
+
+        auto length = min(cluster_size, virtual_size - guest);
+        uint64_t e = entries[i];
+
+        if (e & OFLAG_COMPRESSED)
+            throw runtime_error("Cannot handle compressed qcow2 files.");
+
+        if (e & OFLAG_ZERO)
+            add_run(runs, { guest, length, 0, cluster_state::zero });
+        else if ((e & L2E_OFFSET_MASK) == 0)
+            add_run(runs, { guest, length, 0, cluster_state::unallocated });
+        else
+            add_run(runs, { guest, length, e & L2E_OFFSET_MASK, cluster_state::data });
+    }
+}
+
+// Returns the name of the image's backing file, or an empty string if it
+// doesn't have one.
+string read_backing_file(span<const uint8_t> file) {
+    const auto& h = *(header*)file.data();
+    uint64_t offset = h.backing_file_offset;
+    uint64_t size = h.backing_file_size;
+
+    if (offset == 0)
+        return "";
+
+    if (size > MAX_BACKING_FILE_SIZE || offset + size > file.size())
+        throw runtime_error("qcow2 backing file name not valid");
+
+    return string((char*)file.data() + offset, size);
+}
+
+// Returns the format of the image's backing file, if it's recorded in the
+// header extensions.
+string read_backing_format(span<const uint8_t> file) {
+    const auto& h = *(header*)file.data();
+    uint64_t cluster_size = (uint64_t)1 << h.cluster_bits;
+    uint64_t pos = h.version >= 3 ? (uint32_t)h.header_length : V2_HEADER_LENGTH;
+    auto end = min(cluster_size, (uint64_t)file.size());
+
+    while (pos + sizeof(header_extension) <= end) {
+        const auto& ext = *(header_extension*)(file.data() + pos);
+        uint64_t length = ext.length;
+
+        if (ext.type == EXT_END)
+            break;
+
+        pos += sizeof(header_extension);
+
+        if (pos + length > end)
+            throw runtime_error("qcow2 header extension goes beyond end of cluster");
+
+        if (ext.type == EXT_BACKING_FORMAT)
+            return string((char*)file.data() + pos, length);
+
+        // extensions are aligned to 8 bytes
+        pos = (pos + length + 7) & ~7ull;
+    }
+
+    return "";
+}
+
+// Reads the internal snapshot table of the image in file.
+vector<snapshot> read_snapshots(span<const uint8_t> file) {
+    const auto& h = *(header*)file.data();
+    vector<snapshot> ret;
+    uint64_t pos = h.snapshots_offset;
+
+    for (uint32_t i = 0; i < h.nb_snapshots; i++) {
+        if (pos + sizeof(snapshot_header) > file.size())
+            throw runtime_error("qcow2 snapshot table goes beyond end of file");
+
+        const auto& sh = *(snapshot_header*)(file.data() + pos);
+        uint64_t extra_size = sh.extra_data_size;
+        uint64_t id_size = sh.id_str_size;
+        uint64_t name_size = sh.name_size;
+
+        pos += sizeof(snapshot_header);
+
+        if (pos + extra_size + id_size + name_size > file.size())
+            throw runtime_error("qcow2 snapshot table goes beyond end of file");
+
+        snapshot s;
+
+        s.l1_table_offset = sh.l1_table_offset;
+        s.l1_size = sh.l1_size;
+
+        // older images don't record the size, in which case it's the same as the image's
+        if (extra_size >= offsetof(snapshot_extra, icount))
+            s.disk_size = ((snapshot_extra*)(file.data() + pos))->disk_size;
+        else
+            s.disk_size = h.size;
+
+        pos += extra_size;
+
+        s.id = string((char*)file.data() + pos, id_size);
+        pos += id_size;
+
+        s.name = string((char*)file.data() + pos, name_size);
+        pos += name_size;
+
+        // entries are aligned to 8 bytes
+        pos = (pos + 7) & ~7ull;
+
+        ret.push_back(move(s));
+    }
+
+    return ret;
+}
+
+}
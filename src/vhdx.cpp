@@ -0,0 +1,291 @@
+module;
+
+#include <span>
+#include <algorithm>
+#include <stdexcept>
+#include <format>
+#include <cstring>
+#include <cstddef>
+#include <string_view>
+#include <stdint.h>
+
+export module vhdx;
+
+import discard_check;
+import cxxbtrfs;
+import formatted_error;
+
+using namespace std;
+
+static const uint32_t HEADER_SIGNATURE = 0x64616568; // "head"
+static const uint32_t REGION_SIGNATURE = 0x69676572; // "regi"
+static const uint64_t METADATA_SIGNATURE = 0x617461646174656d; // "metadata"
+
+static const uint64_t HEADER1_OFFSET = 0x10000;
+static const uint64_t HEADER2_OFFSET = 0x20000;
+static const uint64_t REGION_TABLE_OFFSET = 0x30000;
+static const uint64_t HEADER_SIZE = 0x1000;
+static const uint64_t REGION_TABLE_SIZE = 0x10000;
+
+static const uint32_t FILE_PARAMETERS_HAS_PARENT = 1 << 1;
+
+static const uint64_t BAT_STATE_MASK = 7;
+static const unsigned int BAT_OFFSET_SHIFT = 20;
+
+enum class bat_state : uint8_t {
+    not_present = 0,
+    undefined = 1,
+    zero = 2,
+    unmapped = 3,
+    fully_present = 6,
+    partially_present = 7
+};
+
+using guid = uint8_t[16];
+
+static const guid BAT_GUID = {
+    0x66, 0x77, 0xc2, 0x2d, 0x23, 0xf6, 0x00, 0x42, 0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08
+};
+
+static const guid METADATA_GUID = {
+    0x06, 0xa2, 0x7c, 0x8b, 0x90, 0x47, 0x9a, 0x4b, 0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e
+};
+
+static const guid FILE_PARAMETERS_GUID = {
+    0x37, 0x67, 0xa1, 0xca, 0x36, 0xfa, 0x43, 0x4d, 0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b
+};
+
+static const guid VIRTUAL_DISK_SIZE_GUID = {
+    0x24, 0x42, 0xa5, 0x2f, 0x1b, 0xcd, 0x76, 0x48, 0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8
+};
+
+static const guid LOGICAL_SECTOR_SIZE_GUID = {
+    0x1d, 0xbf, 0x41, 0x81, 0x6f, 0xa9, 0x09, 0x47, 0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f
+};
+
+struct vhdx_header {
+    uint32_t signature;
+    uint32_t checksum;
+    uint64_t sequence_number;
+    guid file_write_guid;
+    guid data_write_guid;
+    guid log_guid;
+    uint16_t log_version;
+    uint16_t version;
+    uint32_t log_length;
+    uint64_t log_offset;
+} __attribute__((packed));
+
+struct region_table_header {
+    uint32_t signature;
+    uint32_t checksum;
+    uint32_t entry_count;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct region_table_entry {
+    guid id;
+    uint64_t file_offset;
+    uint32_t length;
+    uint32_t required;
+} __attribute__((packed));
+
+static_assert(sizeof(region_table_entry) == 32);
+
+struct metadata_table_header {
+    uint64_t signature;
+    uint16_t reserved;
+    uint16_t entry_count;
+    uint32_t reserved2[5];
+} __attribute__((packed));
+
+static_assert(sizeof(metadata_table_header) == 32);
+
+struct metadata_table_entry {
+    guid item_id;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t flags;
+    uint32_t reserved;
+} __attribute__((packed));
+
+static_assert(sizeof(metadata_table_entry) == 32);
+
+struct file_parameters {
+    uint32_t block_size;
+    uint32_t flags;
+} __attribute__((packed));
+
+// Checks the crc32c of a header or region table, which is calculated with its
+// own checksum field set to zero.
+static bool checksum_valid(span<const uint8_t> s) {
+    uint8_t buf[REGION_TABLE_SIZE];
+
+    memcpy(buf, s.data(), s.size());
+    memset(buf + offsetof(vhdx_header, checksum), 0, sizeof(uint32_t));
+
+    return btrfs::crc32c(span(buf, s.size())) == *(uint32_t*)(s.data() + offsetof(vhdx_header, checksum));
+}
+
+static span<const uint8_t> get_range(span<const uint8_t> file, uint64_t offset, uint64_t length,
+                                     string_view what) {
+    if (offset + length > file.size())
+        throw formatted_error("VHDX {} goes beyond end of file", what);
+
+    return file.subspan(offset, length);
+}
+
+// Returns whichever of the two headers is valid and most recent.
+static const vhdx_header& current_header(span<const uint8_t> file) {
+    const vhdx_header* ret = nullptr;
+
+    for (auto off : { HEADER1_OFFSET, HEADER2_OFFSET }) {
+        auto s = get_range(file, off, HEADER_SIZE, "header");
+        const auto& h = *(vhdx_header*)s.data();
+
+        if (h.signature != HEADER_SIGNATURE || !checksum_valid(s))
+            continue;
+
+        if (!ret || h.sequence_number > ret->sequence_number)
+            ret = &h;
+    }
+
+    if (!ret)
+        throw runtime_error("VHDX file has no valid header");
+
+    return *ret;
+}
+
+export namespace discard_check {
+
+class vhdx : public mapped_image {
+public:
+    vhdx(const char* filename);
+
+    static bool is_vhdx(span<const uint8_t> file) {
+        return file.size() >= 8 && !memcmp(file.data(), "vhdxfile", 8);
+    }
+
+private:
+    mapping mmap;
+};
+
+}
+
+discard_check::vhdx::vhdx(const char* filename) : mmap(filename) {
+    file = mmap.get_span();
+
+    if (!is_vhdx(file))
+        throw formatted_error("{} is not a VHDX file", filename);
+
+    // we'd have to replay the log to get a consistent view of the file
+
+    const auto& h = current_header(file);
+
+    if (any_of(begin(h.log_guid), end(h.log_guid), [](uint8_t c) { return c != 0; }))
+        throw runtime_error("VHDX file has a log which needs replaying");
+
+    auto rt = get_range(file, REGION_TABLE_OFFSET, REGION_TABLE_SIZE, "region table");
+    const auto& rth = *(region_table_header*)rt.data();
+
+    if (rth.signature != REGION_SIGNATURE || !checksum_valid(rt))
+        throw runtime_error("VHDX region table not valid");
+
+    if (sizeof(region_table_header) + (rth.entry_count * sizeof(region_table_entry)) > rt.size())
+        throw runtime_error("VHDX region table has too many entries");
+
+    auto regions = span((const region_table_entry*)(rt.data() + sizeof(region_table_header)),
+                        rth.entry_count);
+    span<const uint8_t> bat, md;
+
+    for (const auto& r : regions) {
+        if (!memcmp(r.id, BAT_GUID, sizeof(guid)))
+            bat = get_range(file, r.file_offset, r.length, "BAT");
+        else if (!memcmp(r.id, METADATA_GUID, sizeof(guid)))
+            md = get_range(file, r.file_offset, r.length, "metadata region");
+        else if (r.required & 1)
+            throw runtime_error("VHDX file has unrecognized required region");
+    }
+
+    if (bat.empty() || md.empty())
+        throw runtime_error("VHDX file is missing BAT or metadata region");
+
+    // metadata
+
+    if (md.size() < sizeof(metadata_table_header))
+        throw runtime_error("VHDX metadata region too small");
+
+    const auto& mth = *(metadata_table_header*)md.data();
+
+    if (mth.signature != METADATA_SIGNATURE)
+        throw runtime_error("VHDX metadata table not valid");
+
+    if (sizeof(metadata_table_header) + (mth.entry_count * sizeof(metadata_table_entry)) > md.size())
+        throw runtime_error("VHDX metadata table has too many entries");
+
+    auto entries = span((const metadata_table_entry*)(md.data() + sizeof(metadata_table_header)),
+                        mth.entry_count);
+    const file_parameters* fp = nullptr;
+    uint32_t logical_sector_size = 0;
+
+    for (const auto& e : entries) {
+        auto item = get_range(md, e.offset, e.length, "metadata item");
+
+        if (!memcmp(e.item_id, FILE_PARAMETERS_GUID, sizeof(guid)) && item.size() >= sizeof(file_parameters))
+            fp = (const file_parameters*)item.data();
+        else if (!memcmp(e.item_id, VIRTUAL_DISK_SIZE_GUID, sizeof(guid)) && item.size() >= sizeof(uint64_t))
+            virtual_size = *(uint64_t*)item.data();
+        else if (!memcmp(e.item_id, LOGICAL_SECTOR_SIZE_GUID, sizeof(guid)) && item.size() >= sizeof(uint32_t))
+            logical_sector_size = *(uint32_t*)item.data();
+        else if (e.flags & (1 << 2)) // IsRequired
+            throw runtime_error("VHDX file has unrecognized required metadata item");
+    }
+
+    if (!fp || virtual_size == 0 || logical_sector_size == 0)
+        throw runtime_error("VHDX file is missing required metadata");
+
+    if (fp->flags & FILE_PARAMETERS_HAS_PARENT)
+        throw runtime_error("Cannot handle differencing VHDX files.");
+
+    uint64_t block_size = fp->block_size;
+
+    if (block_size == 0 || (block_size & (block_size - 1)) ||
+        ((uint64_t)logical_sector_size << 23) < block_size) {
+        throw formatted_error("VHDX block size {} not valid", block_size);
+    }
+
+    // Every chunk_ratio payload blocks are followed by a sector bitmap entry,
+    // which only means anything for differencing disks.
+
+    auto chunk_ratio = ((uint64_t)logical_sector_size << 23) / block_size;
+    auto blocks = (virtual_size + block_size - 1) / block_size;
+    auto bat_entries = span((const uint64_t*)bat.data(), bat.size() / sizeof(uint64_t));
+
+    if (blocks - 1 + ((blocks - 1) / chunk_ratio) >= bat_entries.size())
+        throw runtime_error("VHDX BAT too small for image");
+
+    for (uint64_t i = 0; i < blocks; i++) {
+        auto e = bat_entries[i + (i / chunk_ratio)];
+        auto guest = i * block_size;
+        auto length = min(block_size, virtual_size - guest);
+
+        switch ((bat_state)(e & BAT_STATE_MASK)) {
+            case bat_state::not_present:
+            case bat_state::undefined:
+                add_run({ false, false, true, guest, length, 0 });
+                break;
+
+            case bat_state::zero:
+            case bat_state::unmapped:
+                add_run({ false, true, true, guest, length, 0 });
+                break;
+
+            case bat_state::fully_present:
+                add_run({ true, true, false, guest, length, (e >> BAT_OFFSET_SHIFT) << 20 });
+                break;
+
+            default:
+                throw formatted_error("VHDX BAT entry {} has unexpected state {}", i, e & BAT_STATE_MASK);
+        }
+    }
+}
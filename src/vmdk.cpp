@@ -0,0 +1,142 @@
+module;
+
+#include <span>
+#include <string_view>
+#include <algorithm>
+#include <stdexcept>
+#include <format>
+#include <cstring>
+#include <stdint.h>
+
+export module vmdk;
+
+import discard_check;
+import formatted_error;
+
+using namespace std;
+
+static const uint32_t SPARSE_MAGIC = 0x564d444b; // "KDMV"
+static const uint64_t SECTOR_SIZE = 512;
+
+static const uint32_t FLAG_COMPRESSED = 1 << 16;
+static const uint32_t FLAG_MARKERS = 1 << 17;
+
+static const uint64_t GD_AT_END = 0xffffffffffffffff;
+
+// Grain table entry for a grain which reads as zeroes, without any space
+// being allocated for it.
+static const uint32_t GTE_ZEROED = 1;
+
+struct sparse_extent_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t capacity; // in sectors
+    uint64_t grain_size; // in sectors
+    uint64_t descriptor_offset;
+    uint64_t descriptor_size;
+    uint32_t num_gtes_per_gt;
+    uint64_t rgd_offset;
+    uint64_t gd_offset;
+    uint64_t overhead;
+    uint8_t unclean_shutdown;
+    char single_end_line_char;
+    char non_end_line_char;
+    char double_end_line_char1;
+    char double_end_line_char2;
+    uint16_t compress_algorithm;
+    uint8_t pad[433];
+} __attribute__((packed));
+
+static_assert(sizeof(sparse_extent_header) == 512);
+
+export namespace discard_check {
+
+class vmdk : public mapped_image {
+public:
+    vmdk(const char* filename);
+
+    static bool is_vmdk(span<const uint8_t> file) {
+        return file.size() >= sizeof(uint32_t) && *(uint32_t*)file.data() == SPARSE_MAGIC;
+    }
+
+private:
+    mapping mmap;
+};
+
+}
+
+discard_check::vmdk::vmdk(const char* filename) : mmap(filename) {
+    file = mmap.get_span();
+
+    if (!is_vmdk(file) || file.size() < sizeof(sparse_extent_header))
+        throw formatted_error("{} is not a sparse VMDK file", filename);
+
+    const auto& h = *(sparse_extent_header*)file.data();
+
+    if (h.version == 0 || h.version > 3)
+        throw formatted_error("Unsupported VMDK version {}.", h.version);
+
+    // streamOptimized images compress every grain, and put the grain directory
+    // at the end of the file
+
+    if (h.flags & (FLAG_COMPRESSED | FLAG_MARKERS) || h.gd_offset == GD_AT_END)
+        throw runtime_error("Cannot handle compressed VMDK files.");
+
+    if (h.descriptor_offset != 0) {
+        if ((h.descriptor_offset + h.descriptor_size) * SECTOR_SIZE > file.size())
+            throw runtime_error("VMDK descriptor goes beyond end of file");
+
+        string_view desc((char*)file.data() + (h.descriptor_offset * SECTOR_SIZE),
+                         h.descriptor_size * SECTOR_SIZE);
+
+        if (desc.find("parentFileNameHint") != string_view::npos)
+            throw runtime_error("Cannot handle VMDK files with a parent.");
+    }
+
+    uint64_t grain_size = h.grain_size * SECTOR_SIZE;
+    uint64_t gtes = h.num_gtes_per_gt;
+
+    if (grain_size == 0 || gtes == 0)
+        throw runtime_error("VMDK header not valid");
+
+    virtual_size = h.capacity * SECTOR_SIZE;
+
+    auto gt_coverage = gtes * grain_size;
+    auto gd_entries = (virtual_size + gt_coverage - 1) / gt_coverage;
+
+    if ((h.gd_offset * SECTOR_SIZE) + (gd_entries * sizeof(uint32_t)) > file.size())
+        throw runtime_error("VMDK grain directory goes beyond end of file");
+
+    auto gd = span((const uint32_t*)(file.data() + (h.gd_offset * SECTOR_SIZE)), gd_entries);
+
+    for (uint64_t i = 0; i < gd_entries; i++) {
+        auto guest = i * gt_coverage;
+
+        if (gd[i] == 0) {
+            add_run({ false, false, true, guest, min(gt_coverage, virtual_size - guest), 0 });
+            continue;
+        }
+
+        if (((uint64_t)gd[i] * SECTOR_SIZE) + (gtes * sizeof(uint32_t)) > file.size())
+            throw formatted_error("VMDK grain table {} goes beyond end of file", i);
+
+        auto gt = span((const uint32_t*)(file.data() + ((uint64_t)gd[i] * SECTOR_SIZE)), gtes);
+
+        for (uint64_t j = 0; j < gtes; j++) {
+            auto g = guest + (j * grain_size);
+
+            if (g >= virtual_size)
+                break;
+
+            auto length = min(grain_size, virtual_size - g);
+
+            if (gt[j] == 0)
+                add_run({ false, false, true, g, length, 0 });
+            else if (gt[j] == GTE_ZEROED)
+                add_run({ false, true, true, g, length, 0 });
+            else
+                add_run({ true, true, false, g, length, (uint64_t)gt[j] * SECTOR_SIZE });
+        }
+    }
+}